@@ -1,4 +1,5 @@
 #include <jack/jack.h>
+#include <jack/midiport.h>
 #include <iostream>
 #include <fstream>
 #include <vector>
@@ -12,28 +13,79 @@
 #include <mutex>
 #include <chrono>
 #include <cctype>
+#include <cstring>
 #include <iomanip>
 #include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <queue>
+#include <tuple>
+#include <filesystem>
+#include <csignal>
+#include <cerrno>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <semaphore.h>
+#endif
+#if defined(MIDA_TRACE) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
 // ---- USER CONFIG ----
-constexpr double BPM = 200.0;
-constexpr double SIXTEENTH = 60.0 / BPM / 4.0;
-constexpr double VOLUME = 0.15;
-constexpr double DRUM_VOL = 0.19;
-constexpr double ATTACK = 0.01;
-constexpr double DECAY = 0.07;
-constexpr double SUSTAIN = 0.7;
-constexpr double RELEASE = 0.2;
-constexpr double DRUM_ATTACK = 0.002;
-constexpr double DRUM_DECAY = 0.09;
-constexpr double DRUM_RELEASE = 0.12;
-constexpr double MAX_SUSTAIN = 10.0;
-constexpr int SAMPLE_RATE = 48000;
-const std::string MIDA_FILENAME = "mida_file.txt";
+// Defaults for every tunable. At startup they are overridden by the config
+// file given with --config (`key = value` lines), then by `--key value` flags.
+// The drum voices are voiced for this drum_vol; other values scale them
+const double DEFAULT_DRUM_VOL = 0.19;
+
+struct Config {
+    double bpm = 200.0;
+    double volume = 0.15;
+    double drum_vol = DEFAULT_DRUM_VOL;
+    double attack = 0.01;
+    double decay = 0.07;
+    double sustain = 0.7;
+    double release = 0.2;
+    double drum_attack = 0.002;
+    double drum_decay = 0.09;
+    double max_sustain = 10.0;
+    double sample_rate = 48000; // used when no JACK server rate is available
+    // --midi-out: velocities follow midi_to_mida.py's type sets (^| >= 110, v| <= 40)
+    double midi_velocity = 100;
+    double drum_note = 38; // GM note of drum audicles without @drum_note
+    double drum_velocity = 80; // *|
+    double drum_accent_velocity = 120; // ^|
+    double drum_ghost_velocity = 32; // v|
+    double midi_lookahead = 0.05; // seconds MIDI is queued ahead of the playhead
+    double lookahead_periods = 2; // process cycles events are queued for the synth ahead of the playhead
+    double cache_mb = 256; // size the cache_dir is trimmed to
+    double tracker_fps = 30; // --tracker redraws at most this often
+    double metrics_port = 0; // serve Prometheus metrics on 127.0.0.1 at this port (off when 0)
+    std::string mida_filename = "mida_file.txt";
+    std::string cache_dir; // where compiled programs are kept between runs (off when empty)
+    std::string trace_file; // where a build with MIDA_TRACE writes its trace at exit
+
+    double sixteenth() const { return 60.0 / bpm / 4.0; }
+};
+
+Config config;
 
 // ---- Note name to MIDI ----
 int noteNameToMidi(const std::string& s) {
@@ -53,7 +105,13 @@ int noteNameToMidi(const std::string& s) {
         if (names[i] == base) { idx = i; break; }
     }
     if (idx == -1) return -1;
-    int octave = std::stoi(s.substr(pos));
+    int octave;
+    try {
+        octave = std::stoi(s.substr(pos));
+    }
+    catch (const std::exception&) {
+        return -1; // no octave yet, as in a half-typed note
+    }
     return 12 * (octave + 1) + idx;
 }
 
@@ -62,7 +120,30 @@ double midiToFreq(int midi) {
 }
 
 // ---- MIDA Parsing ----
-using Timeline = std::vector<std::vector<std::string>>; // [step][tokens]
+// The tokens of one timeline step, and how many steps they last: a hold or rest
+// is one Step however long it runs
+struct Step {
+    std::vector<std::string> notes;
+    size_t length = 1;
+
+    bool operator==(const Step& o) const { return length == o.length && notes == o.notes; }
+    bool operator<(const Step& o) const { return std::tie(length, notes) < std::tie(o.length, o.notes); }
+};
+
+// A stretch of a timeline: `steps` played `repeats` times in a row
+struct TimelineRun {
+    std::vector<Step> steps;
+    size_t length = 0; // in timeline steps, per repetition
+    size_t repeats = 1;
+};
+
+// An audicle's steps in order, with repeated patterns stored once
+struct Timeline {
+    std::vector<TimelineRun> runs;
+    size_t length = 0; // in timeline steps, repeats included
+
+    size_t size() const { return length; }
+};
 
 // Utility: trim whitespace
 std::string trim(const std::string& s) {
@@ -82,40 +163,109 @@ std::vector<std::string> split(const std::string& s, char delim) {
     return out;
 }
 
+// Generated audicles repeat a bar's pattern hundreds of times. Scanning left to
+// right, wherever some period of up to MAX_PERIOD Steps repeats to cover at
+// least MIN_RUN of them, the longest such
+// stretch (the shortest period on a tie) becomes one run; the steps between
+// become runs played once. Steps are compared by id and only periods at which
+// the current step recurs are tried. A multiple of the best period so far is
+// skipped while it is no longer than that period's match: inside a periodic
+// stretch it can only cover less.
+const size_t MAX_PERIOD = 64;
+const size_t MIN_RUN = 8;
+
+Timeline compress_timeline(std::vector<Step>&& steps) {
+    const size_t n = steps.size();
+    std::map<Step, uint32_t> ids_of;
+    std::vector<uint32_t> ids(n);
+    for (size_t i = 0; i < n; ++i)
+        ids[i] = i && steps[i] == steps[i - 1] ? ids[i - 1] : ids_of.emplace(steps[i], uint32_t(ids_of.size())).first->second;
+    std::vector<size_t> next(n), last(ids_of.size(), n);
+    for (size_t i = n; i-- > 0;) {
+        next[i] = last[ids[i]];
+        last[ids[i]] = i;
+    }
+
+    Timeline tl;
+    auto take = [&](size_t from, size_t to, size_t repeats) {
+        if (from == to) return;
+        if (repeats > 1 || tl.runs.empty() || tl.runs.back().repeats > 1) tl.runs.push_back({ {}, 0, repeats });
+        TimelineRun& run = tl.runs.back();
+        for (size_t k = from; k < to; ++k) {
+            run.length += steps[k].length;
+            tl.length += steps[k].length * repeats;
+        }
+        run.steps.insert(run.steps.end(), std::make_move_iterator(steps.begin() + from), std::make_move_iterator(steps.begin() + to));
+    };
+    size_t i = 0, literal = 0;
+    while (i < n) {
+        size_t best_period = 0, best_cover = 0, best_match = 0;
+        for (size_t j = next[i]; j < n && j - i <= MAX_PERIOD && i + 2 * (j - i) <= n; j = next[j]) {
+            size_t p = j - i;
+            if (best_period && p % best_period == 0 && p <= best_match) continue;
+            size_t match = 0;
+            while (j + match < n && ids[i + match] == ids[j + match]) ++match;
+            if (match < p) continue;
+            size_t cover = (match / p + 1) * p;
+            if (cover > best_cover) {
+                best_cover = cover;
+                best_period = p;
+                best_match = match;
+            }
+        }
+        if (best_cover >= MIN_RUN) {
+            take(literal, i, 1);
+            take(i, i + best_period, best_cover / best_period);
+            i += best_cover;
+            literal = i;
+        }
+        else {
+            ++i;
+        }
+    }
+    take(literal, n, 1);
+    return tl;
+}
+
 // ---- Layer 7 Melodic Audicle Parsing ----
 Timeline parse_layer7_audicle(const std::string& audicle) {
-    Timeline timeline;
+    std::vector<Step> timeline;
     std::string body = audicle;
     if (body.front() == '*') body = body.substr(1);
     if (body.back() == '*') body.pop_back();
     std::vector<std::string> tokens = split(body, ' ');
     std::vector<std::string> prev_notes;
+    // Holds and rests extend the step before them when it is the same kind
+    auto hold_or_rest = [&](std::vector<std::string> notes) {
+        if (!timeline.empty() && timeline.back().notes == notes) ++timeline.back().length;
+        else timeline.push_back({ std::move(notes) });
+    };
     for (const auto& tok : tokens) {
         if (tok.empty() || tok == "|") continue;
         if (tok == ".") {
-            timeline.push_back({});
+            hold_or_rest({});
             prev_notes.clear();
         }
         else if (tok == "-") {
             if (!prev_notes.empty()) {
-                timeline.push_back({ "-" });
+                hold_or_rest({ "-" });
             }
             else {
-                timeline.push_back({});
+                hold_or_rest({});
             }
         }
         else {
             std::vector<std::string> notes = split(tok, '~');
-            timeline.push_back(notes);
+            timeline.push_back({ notes });
             prev_notes = notes;
         }
     }
-    return timeline;
+    return compress_timeline(std::move(timeline));
 }
 
 // ---- Layer 5 Drum Audicle Parsing ----
 Timeline parse_layer5_audicle(const std::string& line) {
-    Timeline timeline;
+    std::vector<Step> timeline;
     std::string body = line;
     if (!body.empty() && body.front() == '(' && body.back() == ')')
         body = body.substr(1, body.size() - 2);
@@ -133,14 +283,14 @@ Timeline parse_layer5_audicle(const std::string& line) {
         else if (c == '}') {
             in_group = false;
             std::vector<std::string> group_tokens = split(group_content, ' ');
-            timeline.push_back(group_tokens);
+            timeline.push_back({ group_tokens });
         }
         else if (in_group) {
             group_content += c;
         }
         else if (std::isspace(c)) {
             if (!token.empty()) {
-                timeline.push_back({ token });
+                timeline.push_back({ { token } });
                 token.clear();
             }
         }
@@ -148,8 +298,8 @@ Timeline parse_layer5_audicle(const std::string& line) {
             token += c;
         }
     }
-    if (!token.empty()) timeline.push_back({ token });
-    return timeline;
+    if (!token.empty()) timeline.push_back({ { token } });
+    return compress_timeline(std::move(timeline));
 }
 
 // ---- File Parsing ----
@@ -157,51 +307,367 @@ struct Audicle {
     Timeline timeline;
     bool is_drum;
     std::string name; // For debugging/logging
+    // Length of one timeline step in sixteenths, as a fraction (drums: eighths)
+    size_t step_num = 1;
+    size_t step_den = 1;
+    int drum_note = -1; // GM note sent by --midi-out, from @drum_note (-1: config.drum_note)
+};
+
+// Tempo, meter and swing for the whole file, set by @ directives:
+//   @tempo <bpm> [<step>]   tempo from sixteenth <step> on (default 0)
+//   @meter <num>/<den>      bar length, e.g. 4/4 or 7/8
+//   @swing <percent>        share of each sixteenth pair taken by the first (50 = straight)
+//   @step <num>[/<den>]     sixteenths per step for the next audicle (2/3 = sixteenth triplets)
+//   @drum_note <note>       GM note the next (drum) audicle sends with --midi-out
+// Before the first @tempo the configured bpm applies.
+struct TempoChange {
+    size_t step;
+    double bpm;
+};
+
+struct TempoMap {
+    std::vector<TempoChange> changes; // sorted by step
+    double swing = 50.0;
+    size_t steps_per_bar = 16;
+    size_t beats_per_bar = 4; // the @meter as written, for JACK's BBT
+    size_t beat_type = 4;
+};
+
+bool operator==(const TempoMap& a, const TempoMap& b) {
+    if (a.swing != b.swing || a.steps_per_bar != b.steps_per_bar || a.beats_per_bar != b.beats_per_bar
+        || a.beat_type != b.beat_type || a.changes.size() != b.changes.size())
+        return false;
+    for (size_t i = 0; i < a.changes.size(); ++i)
+        if (a.changes[i].step != b.changes[i].step || a.changes[i].bpm != b.changes[i].bpm) return false;
+    return true;
+}
+
+bool operator!=(const TempoMap& a, const TempoMap& b) { return !(a == b); }
+
+// Parses "n" or "n/d" into positive integers
+bool parse_ratio(const std::string& s, size_t& num, size_t& den) {
+    size_t slash = s.find('/');
+    try {
+        num = std::stoul(s.substr(0, slash));
+        den = slash == std::string::npos ? 1 : std::stoul(s.substr(slash + 1));
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+    return num > 0 && den > 0;
+}
+
+// The step grid counts tempo in thousandths of a bpm, so anything slower rounds to 0
+bool valid_bpm(double bpm) {
+    return bpm > 0 && std::llround(bpm * 1000) > 0;
+}
+
+bool parse_directive(const std::string& line, TempoMap& tempo, size_t& step_num, size_t& step_den, int& drum_note) {
+    std::vector<std::string> args = split(line, ' ');
+    args.erase(std::remove(args.begin(), args.end(), ""), args.end());
+    try {
+        if (args[0] == "@tempo" && (args.size() == 2 || args.size() == 3)) {
+            TempoChange change{ args.size() == 3 ? std::stoul(args[2]) : 0, std::stod(args[1]) };
+            if (!valid_bpm(change.bpm)) return false;
+            auto at = std::upper_bound(tempo.changes.begin(), tempo.changes.end(), change.step,
+                [](size_t step, const TempoChange& c) { return step < c.step; });
+            tempo.changes.insert(at, change);
+            return true;
+        }
+        if (args[0] == "@meter" && args.size() == 2) {
+            size_t num, den;
+            if (!parse_ratio(args[1], num, den) || (num * 16) % den != 0) return false;
+            tempo.steps_per_bar = num * 16 / den;
+            tempo.beats_per_bar = num;
+            tempo.beat_type = den;
+            return true;
+        }
+        if (args[0] == "@swing" && args.size() == 2) {
+            tempo.swing = std::stod(args[1]);
+            return tempo.swing > 0 && tempo.swing < 100;
+        }
+        if (args[0] == "@step" && args.size() == 2) {
+            return parse_ratio(args[1], step_num, step_den);
+        }
+        if (args[0] == "@drum_note" && args.size() == 2) {
+            drum_note = std::stoi(args[1]);
+            return drum_note >= 0 && drum_note < 128;
+        }
+    }
+    catch (const std::exception&) {
+    }
+    return false;
+}
+
+// Song structure. A ‘ line opens a section and the next one closes it; the
+// audicles between them play together, and sections play one after another.
+// A section may be introduced by a header line naming it and a repeat count:
+//   `~# [<name>] [x<count>]
+// A header followed by anything but ‘ plays the named section again, from the
+// same parsed audicles. Audicles outside any block form a section of their own,
+// so a file without markers is a single section.
+struct Section {
+    std::string name;
+    size_t first = 0; // its audicles are [first, first + count)
+    size_t count = 0;
+};
+
+struct SongForm {
+    std::vector<Section> sections;
+    std::vector<size_t> order; // section of each play, in playing order
+};
+
+// Parses the words after `~# into a name and a repeat count
+bool parse_section_header(const std::string& line, std::string& name, size_t& repeat) {
+    std::vector<std::string> args = split(line.substr(3), ' ');
+    args.erase(std::remove(args.begin(), args.end(), ""), args.end());
+    name.clear();
+    repeat = 1;
+    for (const std::string& arg : args) {
+        if (arg.size() > 1 && arg[0] == 'x' && std::all_of(arg.begin() + 1, arg.end(), ::isdigit)) {
+            try {
+                repeat = std::stoul(arg.substr(1));
+            }
+            catch (const std::exception&) {
+                return false;
+            }
+            if (repeat == 0) return false;
+        }
+        else if (name.empty()) {
+            name = arg;
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parsed audicles keyed by a hash of their line and step length. When a file is
+// reparsed with a cache, unchanged lines get their previous Audicle back instead
+// of being parsed again; the cache then holds exactly the lines of the new file.
+struct ParseCache {
+    std::unordered_map<uint64_t, std::shared_ptr<const Audicle>> lines;
+    size_t reused = 0; // audicles taken from the cache by the last parse
 };
 
-std::vector<Audicle> parse_mida_file(const std::string& corpus) {
-    std::vector<Audicle> audicles;
+uint64_t audicle_line_key(const std::string& line, size_t step_num, size_t step_den, int drum_note) {
+    uint64_t key = std::hash<std::string>()(line);
+    key ^= step_num + 0x9e3779b97f4a7c15ull + (key << 6) + (key >> 2);
+    key ^= step_den + 0x9e3779b97f4a7c15ull + (key << 6) + (key >> 2);
+    key ^= uint64_t(drum_note + 1) + 0x9e3779b97f4a7c15ull + (key << 6) + (key >> 2);
+    return key;
+}
+
+std::vector<std::shared_ptr<const Audicle>> parse_mida_file(const std::string& corpus, TempoMap& tempo, SongForm& form,
+    ParseCache* cache = nullptr) {
+    std::vector<std::shared_ptr<const Audicle>> audicles;
+    std::unordered_map<uint64_t, std::shared_ptr<const Audicle>> parsed_lines;
+    if (cache) cache->reused = 0;
     std::istringstream iss(corpus);
     std::string line;
+    size_t step_num = 0, step_den = 0; // from @step, for the next audicle only
+    int drum_note = -1; // from @drum_note, likewise
+
+    form = SongForm();
+    std::map<std::string, size_t> named; // latest section of each name
+    Section open; // the section audicles are being added to
+    size_t open_repeat = 1;
+    bool in_block = false, in_loose = false;
+    bool header = false; // a `~# line is waiting for its block
+    std::string header_name;
+    size_t header_repeat = 1;
+    auto close_section = [&]() {
+        open.count = audicles.size() - open.first;
+        if (!open.name.empty()) named[open.name] = form.sections.size();
+        form.order.insert(form.order.end(), open_repeat, form.sections.size());
+        form.sections.push_back(open);
+        in_block = in_loose = false;
+    };
+    // A header that did not open a block replays the section it names
+    auto replay_header = [&]() {
+        if (!header) return;
+        header = false;
+        auto it = named.find(header_name);
+        if (it == named.end()) std::cerr << "Ignoring repeat of unknown section: " << (header_name.empty() ? "(unnamed)" : header_name) << "\n";
+        else form.order.insert(form.order.end(), header_repeat, it->second);
+    };
+
     while (std::getline(iss, line)) {
         line = trim(line);
         if (line.empty() || line[0] == '/') continue;
-        if (line.front() == '*' && line.back() == '*') {
-            audicles.push_back({ parse_layer7_audicle(line), false, "" });
+        if (line[0] == '@') {
+            if (!parse_directive(line, tempo, step_num, step_den, drum_note))
+                std::cerr << "Ignoring bad directive: " << line << "\n";
+            continue;
+        }
+        if (line.compare(0, 3, "`~#") == 0) {
+            if (in_loose) close_section();
+            replay_header();
+            if (in_block) std::cerr << "Ignoring section header inside a section: " << line << "\n";
+            else if (!parse_section_header(line, header_name, header_repeat)) std::cerr << "Ignoring bad section header: " << line << "\n";
+            else header = true;
+            continue;
+        }
+        if (line == "\xe2\x80\x98") {
+            if (in_loose) close_section();
+            if (in_block) {
+                close_section();
+                continue;
+            }
+            open = Section();
+            open.first = audicles.size();
+            open_repeat = 1;
+            if (header) {
+                open.name = header_name;
+                open_repeat = header_repeat;
+            }
+            header = false;
+            in_block = true;
+            continue;
         }
-        else if (line.front() == '(' && line.back() == ')') {
-            audicles.push_back({ parse_layer5_audicle(line), true, "" });
+        bool is_drum;
+        if (line.front() == '*' && line.back() == '*') is_drum = false;
+        else if (line.front() == '(' && line.back() == ')') is_drum = true;
+        else continue;
+        size_t num = step_num ? step_num : (is_drum ? 2 : 1);
+        size_t den = step_num ? step_den : 1;
+        int note = is_drum ? drum_note : -1;
+        step_num = step_den = 0;
+        drum_note = -1;
+
+        std::shared_ptr<const Audicle> audicle;
+        uint64_t key = audicle_line_key(line, num, den, note);
+        if (cache) {
+            auto it = cache->lines.find(key);
+            if (it != cache->lines.end()) {
+                audicle = it->second;
+                ++cache->reused;
+            }
+        }
+        if (!audicle) {
+            Audicle au{ is_drum ? parse_layer5_audicle(line) : parse_layer7_audicle(line), is_drum, "" };
+            au.step_num = num;
+            au.step_den = den;
+            au.drum_note = note;
+            audicle = std::make_shared<const Audicle>(std::move(au));
+        }
+        if (cache) parsed_lines[key] = audicle;
+        replay_header();
+        if (!in_block && !in_loose) {
+            open = Section();
+            open.first = audicles.size();
+            open_repeat = 1;
+            in_loose = true;
         }
+        audicles.push_back(audicle);
     }
+    if (in_block) std::cerr << "Unterminated section at end of file\n";
+    if (in_block || in_loose) close_section();
+    replay_header();
+    if (cache) cache->lines.swap(parsed_lines);
     return audicles;
 }
 
 // ---- JACK Synth Engine ----
+// Envelopes, auto-release and voice retirement are evaluated once per control
+// block; in between, each voice ramps its gain linearly at audio rate.
+constexpr jack_nframes_t CONTROL_BLOCK = 32;
+
 struct Voice {
     int audicle = 0;
     int midi = -1;
     double freq = 0;
     double phase = 0;
+    double phase_inc = 0;
     double gain = 0;
-    double start_time = 0;
+    size_t elapsed = 0;         // samples rendered since note on
+    double release_at = 0;      // seconds since note on at note off
     bool active = false;
     bool released = false;
-    double release_time = 0;
-    double env_level = 0;
+    double env_level = 0; // envelope at note off, start of the release ramp
+    double env = 0;       // envelope at elapsed, ramped between control points
+    uint32_t next_held = 0; // next slot sounding the same note, while unreleased
 };
 
+// The drum type sets the synth tells apart; any other set plays as a plain hit.
+// Events and voices carry the kind, so neither playback nor loading a compiled
+// program copies or compares strings.
+enum DrumKind : uint8_t { DRUM_PLAIN, DRUM_ACCENT, DRUM_GHOST };
+
+DrumKind drum_kind(const std::string& type) {
+    return type == "^|" ? DRUM_ACCENT : type == "v|" ? DRUM_GHOST : DRUM_PLAIN;
+}
+
 struct DrumVoice {
     int audicle = 0;
-    std::string type;
-    double start_time = 0;
+    DrumKind kind = DRUM_PLAIN;
+    size_t elapsed = 0; // samples rendered since trigger
     double gain = 1.0;
-    double env_level = 1.0;
+    double env = 0;     // drum_env at elapsed, ramped between control points
     bool active = false;
 };
 
+// Everything the render path derives from the config and the sample rate.
+// Tables are built off the audio thread and swapped in under synth_mutex, so
+// render_block only ever multiplies by precomputed coefficients.
+struct SynthTables {
+    double sample_rate = 0;
+    double inv_sample_rate = 0;
+    double phase_inc[128] = {}; // per MIDI note
+    double volume = 0;
+    double max_sustain = 0;
+    // Pitched envelope, in seconds
+    double attack = 0, inv_attack = 0;
+    double decay_end = 0, decay_slope = 0;
+    double sustain = 0;
+    double release = 0, inv_release = 0;
+    double drum_gain = 0;
+    // Drum envelope, in seconds
+    double drum_attack = 0, inv_drum_attack = 0;
+    double drum_end = 0, inv_drum_decay = 0;
+};
+
+std::unique_ptr<SynthTables> build_synth_tables(const Config& cfg, double sample_rate) {
+    std::unique_ptr<SynthTables> tables(new SynthTables);
+    tables->sample_rate = sample_rate;
+    tables->inv_sample_rate = 1.0 / sample_rate;
+    for (int midi = 0; midi < 128; ++midi)
+        tables->phase_inc[midi] = 2 * M_PI * midiToFreq(midi) / sample_rate;
+    tables->volume = cfg.volume;
+    tables->max_sustain = cfg.max_sustain;
+    tables->attack = cfg.attack;
+    tables->inv_attack = 1.0 / cfg.attack;
+    tables->decay_end = cfg.attack + cfg.decay;
+    tables->decay_slope = (1.0 - cfg.sustain) / cfg.decay;
+    tables->sustain = cfg.sustain;
+    tables->release = cfg.release;
+    tables->inv_release = 1.0 / cfg.release;
+    tables->drum_gain = cfg.drum_vol / DEFAULT_DRUM_VOL;
+    tables->drum_attack = cfg.drum_attack;
+    tables->inv_drum_attack = 1.0 / cfg.drum_attack;
+    tables->drum_end = cfg.drum_attack + cfg.drum_decay;
+    tables->inv_drum_decay = 1.0 / cfg.drum_decay;
+    return tables;
+}
+
+// Voices sit in slots that never move while they sound, so a note off needs no
+// search: held_voice[audicle * 128 + midi] heads a chain, through next_held, of
+// the slots of that note's unreleased voices (one, unless a MIDI file strikes
+// the note again before releasing it). A voice leaves its chain when released
+// and its slot goes on free_voices once it falls silent. The tables only grow
+// on note on, so releasing and retiring never allocate.
+const uint32_t NO_VOICE = UINT32_MAX;
+
 std::mutex synth_mutex;
-std::vector<Voice> voices;
+std::vector<Voice> voices; // slots; inactive ones are free
+std::vector<uint32_t> free_voices;
+std::vector<uint32_t> held_voice;
 std::vector<DrumVoice> drum_voices;
+std::unique_ptr<SynthTables> synth_tables = build_synth_tables(config, config.sample_rate);
+// Written by JACK's sample rate callback, picked up by the scheduler thread
+std::atomic<jack_nframes_t> pending_sample_rate{ 0 };
+std::atomic<double> playback_sample_rate{ 0 }; // the rate the playing program is scheduled at
 
 // Improved oscillator: sine + triangle + saw
 double improved_osc(double phase) {
@@ -212,41 +678,36 @@ double improved_osc(double phase) {
 }
 
 // Envelope for pitched synths
-double envelope(const Voice& v, double t) {
+double envelope(const Voice& v, double t, const SynthTables& k) {
     if (!v.released) {
-        if (t < ATTACK) return (t / ATTACK);
-        else if (t < ATTACK + DECAY) return 1.0 - (1.0 - SUSTAIN) * ((t - ATTACK) / DECAY);
-        else return SUSTAIN;
+        if (t < k.attack) return t * k.inv_attack;
+        else if (t < k.decay_end) return 1.0 - (t - k.attack) * k.decay_slope;
+        else return k.sustain;
     }
     else {
-        double rel_t = t - (v.release_time - v.start_time);
-        double env = v.env_level * ((1.0 - rel_t / RELEASE) > 0.0 ? (1.0 - rel_t / RELEASE) : 0.0);
-        if (rel_t > RELEASE) return 0.0;
-        return env;
+        double rel_t = t - v.release_at;
+        if (rel_t >= k.release) return 0.0;
+        return v.env_level * (1.0 - rel_t * k.inv_release);
     }
 }
 
 // Envelope for drums
-double drum_env(double t) {
-    if (t < DRUM_ATTACK) return t / DRUM_ATTACK;
-    else if (t < DRUM_ATTACK + DRUM_DECAY) return 1.0 - (t - DRUM_ATTACK) / DRUM_DECAY;
+double drum_env(double t, const SynthTables& k) {
+    if (t < k.drum_attack) return t * k.inv_drum_attack;
+    else if (t < k.drum_end) return 1.0 - (t - k.drum_attack) * k.inv_drum_decay;
     else return 0.0;
 }
 
-// Drum synthesis: different type set symbols get different timbres
-double drum_sample(const DrumVoice& v, double t) {
-    double env = drum_env(t) * v.gain;
-    if (v.type == "*|") {
-        double noise = ((rand() % 2000) / 1000.0 - 1.0) * env;
-        double click = std::sin(2 * M_PI * 200.0 * t) * env * 0.5;
-        return noise * 0.6 + click * 0.4;
-    }
-    if (v.type == "^|") {
+// Drum synthesis: different type set symbols get different timbres.
+// env is the interpolated drum_env value at t.
+double drum_sample(const DrumVoice& v, double t, double env) {
+    env *= v.gain;
+    if (v.kind == DRUM_ACCENT) {
         double noise = ((rand() % 2000) / 1000.0 - 1.0) * env * 1.5;
         double click = std::sin(2 * M_PI * 320.0 * t) * env * 0.8;
         return noise * 0.7 + click * 0.6;
     }
-    if (v.type == "v|") {
+    if (v.kind == DRUM_GHOST) {
         double noise = ((rand() % 2000) / 1000.0 - 1.0) * env * 0.5;
         double click = std::sin(2 * M_PI * 120.0 * t) * env * 0.2;
         return noise * 0.8 + click * 0.2;
@@ -256,299 +717,3405 @@ double drum_sample(const DrumVoice& v, double t) {
     return noise * 0.6 + click * 0.4;
 }
 
-// ---- JACK callback with atomic playhead ----
-std::atomic<size_t> global_playhead_samples{ 0 };
-
-int jack_callback(jack_nframes_t nframes, void* arg) {
-    float* out = (float*)jack_port_get_buffer((jack_port_t*)arg, nframes);
-    static double sample_rate = SAMPLE_RATE;
-    std::lock_guard<std::mutex> lock(synth_mutex);
-    for (jack_nframes_t i = 0; i < nframes; ++i) {
-        double t = global_playhead_samples.load() / sample_rate;
-        double sample = 0.0;
-        for (size_t vi = 0; vi < voices.size(); ++vi) {
-            Voice& v = voices[vi];
-            if (v.active) {
-                double rel_t = t - v.start_time;
-                double env = envelope(v, rel_t);
-                sample += improved_osc(v.phase) * v.gain * env;
-                v.phase += 2 * M_PI * v.freq / sample_rate;
-                if (!v.released && rel_t > MAX_SUSTAIN) {
-                    v.released = true;
-                    v.release_time = t;
-                    v.env_level = envelope(v, rel_t);
-                }
-                if ((!v.released && env <= 0.0) || (v.released && env <= 0.0))
-                    v.active = false;
-            }
-        }
-        for (size_t vi = 0; vi < drum_voices.size(); ++vi) {
-            DrumVoice& v = drum_voices[vi];
-            if (v.active) {
-                double rel_t = t - v.start_time;
-                double env = drum_env(rel_t) * v.gain;
-                sample += drum_sample(v, rel_t);
-                if (env <= 0.0)
-                    v.active = false;
-            }
-        }
-        out[i] = static_cast<float>(sample);
-        global_playhead_samples++;
-    }
-    voices.erase(std::remove_if(voices.begin(), voices.end(),
-        [](const Voice& v) { return !v.active; }), voices.end());
-    drum_voices.erase(std::remove_if(drum_voices.begin(), drum_voices.end(),
-        [](const DrumVoice& v) { return !v.active; }), drum_voices.end());
-    return 0;
+// Takes a voice out of its note's chain; expects synth_mutex held
+static void unlink_held_voice(uint32_t slot) {
+    const Voice& v = voices[slot];
+    uint32_t* link = &held_voice[size_t(v.audicle) * 128 + v.midi];
+    while (*link != slot) link = &voices[*link].next_held;
+    *link = v.next_held;
 }
 
-void trigger_note(int audicle, int midi, double freq, double start_time) {
-    std::lock_guard<std::mutex> lock(synth_mutex);
+// What an event does to the voices, `late` samples after its time: a voice
+// starts with the lateness already on its clock so it stays aligned to its
+// scheduled sample. These expect synth_mutex held.
+//
+// A velocity from a MIDI file scales the gain relative to config.midi_velocity,
+// so notes at the default velocity sound like MIDA notes
+void start_voice(int audicle, int midi, double freq, size_t late, int velocity) {
+    if (audicle < 0 || midi < 0 || midi > 127) return;
+    size_t note = size_t(audicle) * 128 + midi;
+    if (note >= held_voice.size()) held_voice.resize(note - midi + 128, NO_VOICE);
+    uint32_t slot;
+    if (!free_voices.empty()) {
+        slot = free_voices.back();
+        free_voices.pop_back();
+    }
+    else {
+        slot = uint32_t(voices.size());
+        voices.emplace_back();
+    }
     Voice v;
     v.audicle = audicle;
     v.midi = midi;
     v.freq = freq;
     v.phase = 0;
-    v.gain = VOLUME;
+    v.phase_inc = (midi >= 0 && midi < 128) ? synth_tables->phase_inc[midi] : 2 * M_PI * freq * synth_tables->inv_sample_rate;
+    v.gain = synth_tables->volume * (velocity ? velocity / config.midi_velocity : 1.0);
     v.active = true;
     v.released = false;
-    v.start_time = start_time;
-    voices.push_back(v);
+    v.elapsed = late;
+    v.env = envelope(v, v.elapsed * synth_tables->inv_sample_rate, *synth_tables);
+    v.next_held = held_voice[note];
+    held_voice[note] = slot;
+    voices[slot] = v;
 }
 
-void release_note(int audicle, int midi, double rel_time) {
-    std::lock_guard<std::mutex> lock(synth_mutex);
-    for (size_t vi = 0; vi < voices.size(); ++vi) {
-        Voice& v = voices[vi];
-        if (v.active && !v.released && v.audicle == audicle && v.midi == midi) {
-            v.released = true;
-            v.release_time = rel_time;
-            double t = rel_time - v.start_time;
-            v.env_level = envelope(v, t);
-        }
+void release_voices(int audicle, int midi, size_t late) {
+    if (audicle < 0 || midi < 0 || midi > 127) return;
+    size_t note = size_t(audicle) * 128 + midi;
+    if (note >= held_voice.size()) return;
+    for (uint32_t slot = held_voice[note]; slot != NO_VOICE; slot = voices[slot].next_held) {
+        Voice& v = voices[slot];
+        v.release_at = (v.elapsed > late ? v.elapsed - late : 0) * synth_tables->inv_sample_rate;
+        v.env_level = envelope(v, v.release_at, *synth_tables);
+        v.released = true;
     }
+    held_voice[note] = NO_VOICE;
 }
 
-void trigger_drum(int audicle, const std::string& type, double start_time) {
-    std::lock_guard<std::mutex> lock(synth_mutex);
+// Releases every held note, as of `late` samples ago
+void release_all_voices(size_t late) {
+    for (Voice& v : voices) {
+        if (!v.active || v.released) continue;
+        v.release_at = (v.elapsed > late ? v.elapsed - late : 0) * synth_tables->inv_sample_rate;
+        v.env_level = envelope(v, v.release_at, *synth_tables);
+        v.released = true;
+    }
+    std::fill(held_voice.begin(), held_voice.end(), NO_VOICE);
+}
+
+void start_drum_voice(int audicle, DrumKind kind, size_t late) {
     DrumVoice v;
     v.audicle = audicle;
-    v.type = type;
-    v.start_time = start_time;
-    v.gain = (type == "^|") ? 1.6 : (type == "v|") ? 0.5 : 1.0;
+    v.kind = kind;
+    v.elapsed = late;
+    v.env = drum_env(v.elapsed * synth_tables->inv_sample_rate, *synth_tables);
+    v.gain = (kind == DRUM_ACCENT ? 1.6 : kind == DRUM_GHOST ? 0.5 : 1.0) * synth_tables->drum_gain;
     v.active = true;
     drum_voices.push_back(v);
 }
 
-// ---- Event Scheduling ----
-struct ScheduledEvent {
-    size_t sample_index;
-    enum Type { NOTE_ON, NOTE_OFF, DRUM_ON, LOG_ROW } type;
+// ---- Metrics ----
+// Live counters for the metrics endpoint. The audio callback and the playback
+// thread only ever store to them with relaxed atomics and the server only
+// reads, so watching them costs the audio thread no locks and no waits.
+struct Metrics {
+    std::atomic<size_t> voices{ 0 }; // pitched voices sounding, as of the last block
+    std::atomic<size_t> drum_voices{ 0 };
+    std::atomic<uint64_t> callbacks{ 0 };
+    std::atomic<uint64_t> callback_ns{ 0 }; // time spent in the process callback
+    std::atomic<uint64_t> frames{ 0 };
+    std::atomic<double> callback_load_peak{ 0 }; // worst cycle's time over its period since the last scrape
+    std::atomic<uint64_t> xruns{ 0 };
+    std::atomic<size_t> events_pending{ 0 }; // scheduled events not yet queued
+    std::atomic<uint64_t> events_queued{ 0 };
+    std::atomic<uint64_t> events_late{ 0 }; // applied after their sample had been rendered
+    std::atomic<size_t> midi_queued{ 0 };
+};
+
+Metrics metrics;
+
+// ---- Tracing ----
+// Built with -DMIDA_TRACE and run with trace_file set, the audio callback and
+// the playback thread record what they do into per-thread rings holding the
+// latest TRACE_CAPACITY records, written at exit as a Chrome trace for Perfetto
+// or chrome://tracing. A record is a timestamp counter read and one store into
+// the thread's own ring: no locks, no sharing, and no allocation. The rings
+// are allocated and faulted in by start_trace, before the threads start, and
+// each thread claims its own by name. Without MIDA_TRACE the TRACE macros
+// compile to nothing.
+#ifdef MIDA_TRACE
+enum TraceKind : uint16_t {
+    TRACE_CALLBACK_BEGIN, TRACE_CALLBACK_END, // b: playhead / pitched voices, a: drum voices
+    TRACE_LOCK_BEGIN, TRACE_LOCK_END, // render_block waiting for synth_mutex
+    TRACE_DISPATCH, // c: event type << 8 | midi, a: audicle, b: samples late when queued (negative: early)
+    TRACE_WAIT_BEGIN, TRACE_WAIT_END, // the playback thread waiting for the next period
+    TRACE_SCHEDULE_BEGIN, TRACE_SCHEDULE_END, // rescheduling on the playback thread
+    TRACE_XRUN,
+    TRACE_LATE_EVENT, // a: audicle, b: samples late
+};
+
+struct TraceRecord {
+    uint64_t ticks;
+    uint16_t kind;
+    uint16_t c;
+    uint32_t a;
+    uint64_t b;
+};
+
+const size_t TRACE_CAPACITY = size_t(1) << 20; // per thread, a power of two
+
+struct TraceRing {
+    const char* name;
+    std::atomic<bool> claimed{ false };
+    uint64_t head = 0;
+    std::unique_ptr<TraceRecord[]> records{ new TraceRecord[TRACE_CAPACITY] };
+};
+
+// One ring per recording thread; a thread not named here records nothing
+const char* const TRACE_THREADS[] = { "process", "playback" };
+
+bool trace_on = false; // set before any thread starts
+uint64_t trace_start_ticks = 0;
+std::chrono::steady_clock::time_point trace_start_time;
+std::vector<std::unique_ptr<TraceRing>> trace_rings; // fixed once trace_on is set
+thread_local TraceRing* trace_ring = nullptr;
+
+inline uint64_t trace_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Only searches and flags, so it is safe on the audio thread
+inline void trace_claim(const char* name) {
+    if (!trace_on || trace_ring) return;
+    for (const auto& ring : trace_rings)
+        if (std::strcmp(ring->name, name) == 0 && !ring->claimed.exchange(true)) {
+            trace_ring = ring.get();
+            return;
+        }
+}
+
+inline void trace_record(uint16_t kind, uint16_t c, uint32_t a, uint64_t b) {
+    if (!trace_on || !trace_ring) return;
+    TraceRing* ring = trace_ring;
+    ring->records[ring->head++ & (TRACE_CAPACITY - 1)] = { trace_ticks(), kind, c, a, b };
+}
+
+// Must run before any recording thread starts
+void start_trace() {
+    for (const char* name : TRACE_THREADS) {
+        trace_rings.emplace_back(new TraceRing{ name });
+        // Touch every page now so the first pass through the ring does not fault
+        std::fill(trace_rings.back()->records.get(), trace_rings.back()->records.get() + TRACE_CAPACITY, TraceRecord{});
+    }
+    trace_start_time = std::chrono::steady_clock::now();
+    trace_start_ticks = trace_ticks();
+    trace_on = true;
+}
+
+// Expects every recording thread to have stopped. Ticks are converted to
+// microseconds by the rate they ran at over the whole trace.
+bool write_trace(const std::string& path) {
+    double us_per_tick = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - trace_start_time).count()
+        / double(trace_ticks() - trace_start_ticks);
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Could not write trace: " << path << "\n";
+        return false;
+    }
+    static const char* const EVENT_NAMES[] = { "note on", "note off", "drum" };
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+    const char* sep = "";
+    for (size_t t = 0; t < trace_rings.size(); ++t) {
+        const TraceRing& ring = *trace_rings[t];
+        out << sep << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t + 1
+            << ",\"args\":{\"name\":\"" << ring.name << "\"}}";
+        sep = ",\n";
+        for (uint64_t i = ring.head > TRACE_CAPACITY ? ring.head - TRACE_CAPACITY : 0; i < ring.head; ++i) {
+            const TraceRecord& r = ring.records[i & (TRACE_CAPACITY - 1)];
+            double ts = double(int64_t(r.ticks - trace_start_ticks)) * us_per_tick;
+            out << sep << "{\"pid\":1,\"tid\":" << t + 1 << ",\"ts\":" << ts << ",";
+            switch (r.kind) {
+            case TRACE_CALLBACK_BEGIN:
+                out << "\"name\":\"process\",\"ph\":\"B\",\"args\":{\"playhead\":" << r.b << "}}";
+                break;
+            case TRACE_CALLBACK_END:
+                out << "\"name\":\"process\",\"ph\":\"E\"},\n{\"pid\":1,\"tid\":" << t + 1 << ",\"ts\":" << ts
+                    << ",\"name\":\"voices\",\"ph\":\"C\",\"args\":{\"pitched\":" << r.b << ",\"drum\":" << r.a << "}}";
+                break;
+            case TRACE_LOCK_BEGIN:
+            case TRACE_LOCK_END:
+                out << "\"name\":\"synth_mutex wait\",\"ph\":\"" << (r.kind == TRACE_LOCK_BEGIN ? "B" : "E") << "\"}";
+                break;
+            case TRACE_DISPATCH:
+                out << "\"name\":\"" << EVENT_NAMES[std::min(r.c >> 8, 2)] << "\",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"audicle\":"
+                    << r.a + 1 << ",\"midi\":" << int(int8_t(r.c & 0xff)) << ",\"late_samples\":" << int64_t(r.b) << "}}";
+                break;
+            case TRACE_WAIT_BEGIN:
+            case TRACE_WAIT_END:
+                out << "\"name\":\"period wait\",\"ph\":\"" << (r.kind == TRACE_WAIT_BEGIN ? "B" : "E") << "\"}";
+                break;
+            case TRACE_SCHEDULE_BEGIN:
+            case TRACE_SCHEDULE_END:
+                out << "\"name\":\"schedule\",\"ph\":\"" << (r.kind == TRACE_SCHEDULE_BEGIN ? "B" : "E") << "\"}";
+                break;
+            case TRACE_LATE_EVENT:
+                out << "\"name\":\"late event\",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"audicle\":" << r.a + 1
+                    << ",\"late_samples\":" << r.b << "}}";
+                break;
+            default:
+                out << "\"name\":\"xrun\",\"ph\":\"i\",\"s\":\"g\"}";
+                break;
+            }
+        }
+    }
+    out << "\n]}\n";
+    return bool(out);
+}
+
+#define TRACE(kind, c, a, b) trace_record(kind, uint16_t(c), uint32_t(a), uint64_t(b))
+#define TRACE_THREAD(name) trace_claim(name)
+#else
+#define TRACE(kind, c, a, b) ((void)0)
+#define TRACE_THREAD(name) ((void)0)
+#endif
+
+// ---- Audio event queue ----
+// The playback thread queues events lookahead_periods ahead of the playhead
+// and the process callback applies each one at its own sample, starting a new
+// control block there, so events are on time however late the playback thread
+// wakes. One queued after its sample was rendered is applied with its lateness
+// on the voice clock and counted in metrics.events_late. The queue is under
+// synth_mutex like the voices.
+//
+// A transport relocation bumps locate_generation after moving the playhead.
+// The playback thread reads the generation before the playhead and stamps it
+// on what it queues, so events chosen for the old position carry an old
+// generation and the callback drops them. They were queued before any newer
+// ones, so they are always at the front.
+//
+// A loop wraps in the callback too: LOOP_WRAP releases the held notes and
+// moves the playhead back to the loop start at its sample, and what follows
+// it in the queue is on the clock after the wrap. So the queue is in the order
+// events play, which is sample order but for the wraps.
+struct QueuedEvent {
+    size_t sample;
+    enum Type { NOTE_ON, NOTE_OFF, DRUM_ON, LOOP_WRAP } type;
+    int audicle;
     int midi;
-    int audicle_idx;
+    int velocity;
     double freq;
-    std::string drum_type;
-    std::vector<std::string> log_cells; // Only for LOG_ROW
+    DrumKind drum;
+    size_t sounded = 0; // NOTE_ON: samples a note held into the loop has already played
+    size_t wrap_to = 0; // LOOP_WRAP: the loop start
+    uint32_t generation = 0;
 };
 
-void schedule_events_and_log(
-    const std::vector<Audicle>& audicles,
-    std::vector<ScheduledEvent>& events,
-    size_t& total_samples
-) {
-    size_t n_aud = audicles.size();
-    // max_steps: the longest timeline, in 16ths, among all audicles
-    size_t max_steps = 0;
-    for (size_t i = 0; i < n_aud; ++i) {
-        size_t steps = audicles[i].is_drum ? audicles[i].timeline.size() * 2 : audicles[i].timeline.size();
-        if (steps > max_steps) max_steps = steps;
+std::vector<QueuedEvent> audio_queue; // in play order
+std::atomic<uint32_t> locate_generation{ 0 };
+size_t loop_wraps = 0; // queued wraps applied so far; under synth_mutex
+std::atomic<jack_nframes_t> period_frames{ 0 }; // length of the last process cycle
+
+// Applies a queued event as of sample `now`; expects synth_mutex held
+void apply_queued_event(const QueuedEvent& e, size_t now) {
+    size_t late = now > e.sample ? now - e.sample : 0;
+    if (late) {
+        metrics.events_late.fetch_add(1, std::memory_order_relaxed);
+        TRACE(TRACE_LATE_EVENT, 0, e.audicle, late);
     }
-    total_samples = static_cast<size_t>(std::ceil(max_steps * SIXTEENTH * SAMPLE_RATE));
+    if (e.type == QueuedEvent::NOTE_ON) start_voice(e.audicle, e.midi, e.freq, e.sounded + late, e.velocity);
+    else if (e.type == QueuedEvent::NOTE_OFF) release_voices(e.audicle, e.midi, late);
+    else if (e.type == QueuedEvent::DRUM_ON) start_drum_voice(e.audicle, e.drum, late);
+    else release_all_voices(late);
+}
 
-    // Prepare log grid and schedule events
-    std::vector<std::vector<std::string>> log_grid(max_steps, std::vector<std::string>(n_aud));
-    for (size_t a = 0; a < n_aud; ++a) {
-        const Timeline& tl = audicles[a].timeline;
-        bool is_drum = audicles[a].is_drum;
-        std::set<int> prev_midi;
-        std::vector<std::string> prev_notes;
-        if (is_drum) {
-            // VISUALLY UPSAMPLE: repeat each drum cell for two 16th rows
-            for (size_t drum_step = 0; drum_step < tl.size(); ++drum_step) {
-                // Construct cell
-                std::string cell;
-                const auto& notes = tl[drum_step];
-                if (notes.empty())
-                    cell = "_";
-                else if (notes.size() == 1)
-                    cell = notes[0];
-                else {
-                    cell = "{";
-                    for (size_t n = 0; n < notes.size(); ++n) {
-                        if (n) cell += " ";
-                        cell += notes[n];
-                    }
-                    cell += "}";
-                }
-                // Repeat for both 16th rows
-                size_t row1 = 2 * drum_step;
-                size_t row2 = 2 * drum_step + 1;
-                if (row1 < max_steps) log_grid[row1][a] = cell;
-                if (row2 < max_steps) log_grid[row2][a] = cell;
-                // Schedule drum audio event ONLY at row1 (even step)
-                double t = row1 * SIXTEENTH;
-                size_t sample_idx = static_cast<size_t>(std::round(t * SAMPLE_RATE));
-                for (size_t n = 0; n < notes.size(); ++n) {
-                    if (notes[n] != "_") {
-                        events.push_back({ sample_idx, ScheduledEvent::DRUM_ON, -1, (int)a, 0.0, notes[n], {} });
-                    }
+// Events arrive in play order, after reserve_synth has made room for them, so
+// neither queueing nor applying them allocates. Expects synth_mutex held.
+void queue_audio_event(QueuedEvent e, uint32_t generation) {
+    e.generation = generation;
+    audio_queue.push_back(e);
+}
+
+// ---- JACK callback with atomic playhead ----
+// The playhead is only ever advanced by the audio thread: it is loaded once per
+// block and published once at the end with a release store, so readers see a
+// whole block at a time and the render loop never touches the atomic.
+std::atomic<size_t> global_playhead_samples{ 0 };
+
+void render_block(float* out, jack_nframes_t nframes, bool advance = true) {
+    TRACE(TRACE_LOCK_BEGIN, 0, 0, 0);
+    std::lock_guard<std::mutex> lock(synth_mutex);
+    TRACE(TRACE_LOCK_END, 0, 0, 0);
+    const SynthTables& tables = *synth_tables;
+    const double inv_sample_rate = tables.inv_sample_rate;
+    size_t playhead = global_playhead_samples.load(std::memory_order_relaxed);
+    uint32_t generation = locate_generation.load(std::memory_order_relaxed);
+    size_t stale = 0;
+    while (stale < audio_queue.size() && audio_queue[stale].generation != generation) ++stale;
+    audio_queue.erase(audio_queue.begin(), audio_queue.begin() + stale);
+    size_t applied = 0; // queued events applied so far
+    jack_nframes_t n;
+    for (jack_nframes_t start = 0; start < nframes; start += n) {
+        n = std::min(CONTROL_BLOCK, nframes - start);
+        if (advance) {
+            // Apply what is due and end this control block at the next event
+            size_t now = playhead + start;
+            for (; applied < audio_queue.size() && audio_queue[applied].sample <= now; ++applied) {
+                const QueuedEvent& e = audio_queue[applied];
+                apply_queued_event(e, now);
+                if (e.type == QueuedEvent::LOOP_WRAP) {
+                    // Go on from the loop start, as late as the wrap was
+                    now = e.wrap_to + (now - e.sample);
+                    playhead = now - start; // may wrap around, as only playhead + start is used
+                    ++loop_wraps;
                 }
             }
-            // Fill any remaining log rows with "_"
-            for (size_t step = 2 * tl.size(); step < max_steps; ++step) {
-                log_grid[step][a] = "_";
-            }
+            if (applied < audio_queue.size() && audio_queue[applied].sample < now + n)
+                n = jack_nframes_t(audio_queue[applied].sample - now);
         }
-        else {
-            // Melodic: as usual
-            for (size_t step = 0; step < max_steps; ++step) {
-                std::string cell;
-                double t = step * SIXTEENTH;
-                size_t sample_idx = static_cast<size_t>(std::round(t * SAMPLE_RATE));
-                if (step < tl.size()) {
-                    const auto& notes = tl[step];
-                    if (notes.empty()) cell = ".";
-                    else if (notes.size() == 1 && notes[0] == "-") cell = "-";
-                    else if (notes.size() == 1) cell = notes[0];
-                    else {
-                        for (size_t n = 0; n < notes.size(); ++n) {
-                            if (n) cell += "~";
-                            cell += notes[n];
-                        }
-                    }
-                    std::set<int> current_midi;
-                    if (notes.size() == 1 && notes[0] == "-") {
-                        for (size_t i = 0; i < prev_notes.size(); ++i) {
-                            int midi = noteNameToMidi(prev_notes[i]);
-                            if (midi > 0) current_midi.insert(midi);
-                        }
-                    }
-                    else {
-                        for (size_t i = 0; i < notes.size(); ++i) {
-                            int midi = noteNameToMidi(notes[i]);
-                            if (midi > 0) current_midi.insert(midi);
-                        }
-                        prev_notes = notes;
-                    }
-                    for (auto midi : current_midi) {
-                        if (prev_midi.count(midi) == 0) {
-                            events.push_back({ sample_idx, ScheduledEvent::NOTE_ON, midi, (int)a, midiToFreq(midi), "", {} });
-                        }
-                    }
-                    for (auto midi : prev_midi) {
-                        if (current_midi.count(midi) == 0) {
-                            events.push_back({ sample_idx, ScheduledEvent::NOTE_OFF, midi, (int)a, midiToFreq(midi), "", {} });
-                        }
-                    }
-                    prev_midi = current_midi;
-                }
-                else {
-                    cell = ".";
-                }
-                log_grid[step][a] = cell;
+        double mix[CONTROL_BLOCK] = {};
+        for (size_t vi = 0; vi < voices.size(); ++vi) {
+            Voice& v = voices[vi];
+            if (!v.active) continue;
+            // Control stage: auto-release, then the envelope target at the end of this block
+            if (!v.released && v.elapsed * inv_sample_rate > tables.max_sustain) {
+                v.release_at = v.elapsed * inv_sample_rate;
+                v.env_level = v.env;
+                v.released = true;
+                unlink_held_voice(uint32_t(vi));
             }
-            // Schedule note offs at the end
-            if (tl.size() > 0) {
-                size_t sample_idx = static_cast<size_t>(std::round(tl.size() * SIXTEENTH * SAMPLE_RATE));
-                for (auto midi : prev_midi) {
-                    events.push_back({ sample_idx, ScheduledEvent::NOTE_OFF, midi, (int)a, midiToFreq(midi), "", {} });
-                }
+            double target = envelope(v, (v.elapsed + n) * inv_sample_rate, tables);
+            double step = (target - v.env) / n;
+            double env = v.env;
+            for (jack_nframes_t k = 0; k < n; ++k) {
+                mix[k] += improved_osc(v.phase) * v.gain * env;
+                v.phase += v.phase_inc;
+                env += step;
+            }
+            v.env = target;
+            v.elapsed += n;
+            // The attack starts from zero, so only a released voice is done at env 0
+            if (v.released && target <= 0.0) {
+                v.active = false;
+                free_voices.push_back(uint32_t(vi));
+            }
+        }
+        for (size_t vi = 0; vi < drum_voices.size(); ++vi) {
+            DrumVoice& v = drum_voices[vi];
+            if (!v.active) continue;
+            double target = drum_env((v.elapsed + n) * inv_sample_rate, tables);
+            double step = (target - v.env) / n;
+            double env = v.env;
+            for (jack_nframes_t k = 0; k < n; ++k) {
+                mix[k] += drum_sample(v, (v.elapsed + k) * inv_sample_rate, env);
+                env += step;
             }
+            v.env = target;
+            v.elapsed += n;
+            if (v.elapsed * inv_sample_rate >= tables.drum_end)
+                v.active = false;
         }
+        for (jack_nframes_t k = 0; k < n; ++k)
+            out[start + k] = static_cast<float>(mix[k]);
     }
-    // Schedule log rows
-    for (size_t step = 0; step < max_steps; ++step) {
-        size_t sample_idx = static_cast<size_t>(std::round(step * SIXTEENTH * SAMPLE_RATE));
-        events.push_back({ sample_idx, ScheduledEvent::LOG_ROW, -1, -1, 0.0, "", log_grid[step] });
+    drum_voices.erase(std::remove_if(drum_voices.begin(), drum_voices.end(),
+        [](const DrumVoice& v) { return !v.active; }), drum_voices.end());
+    audio_queue.erase(audio_queue.begin(), audio_queue.begin() + applied);
+    metrics.voices.store(voices.size() - free_voices.size(), std::memory_order_relaxed);
+    metrics.drum_voices.store(drum_voices.size(), std::memory_order_relaxed);
+    if (advance) global_playhead_samples.store(playhead + nframes, std::memory_order_release);
+}
+
+// With --jack-transport the playhead is the transport frame. The callback only
+// flags starts, stops and relocations; the playback thread does the seeking.
+// A relocation is flagged before the playhead moves, so a thread that sees the
+// new playhead also sees the flag and never dispatches the skipped events.
+jack_client_t* transport_client = nullptr;
+std::atomic<bool> transport_rolling{ true };
+std::atomic<bool> transport_located{ false };
+
+// A note sounding at some point: when it started, and how hard
+struct HeldNote {
+    size_t since; // sample of its NOTE_ON
+    int velocity; // 0: the MIDA default
+};
+
+// (audicle, midi) -> the note, for every note sounding at some point
+typedef std::map<std::pair<int, int>, HeldNote> HeldNotes;
+
+// ---- JACK MIDI output ----
+// With --midi-out every note and drum hit is also sent as MIDI. The playback
+// thread queues messages config.midi_lookahead ahead of the playhead and the
+// process callback writes each at its exact frame in the cycle. Melodic
+// audicle n sends on channel n, skipping the GM drum channel 10 and wrapping
+// after 15; drum audicles all send on channel 10. At a queued loop wrap the
+// callback silences what is sounding and goes on with midi_after_wrap, which
+// holds what was queued for after it.
+struct MidiMessage {
+    size_t sample;
+    unsigned char data[3];
+};
+
+const int MIDI_DRUM_CHANNEL = 9;
+jack_port_t* midi_port = nullptr;
+std::vector<MidiMessage> midi_queue; // in sample order; under synth_mutex like the rest below
+std::set<std::pair<int, int>> midi_held; // (audicle, midi) notes on, as queued
+bool midi_panic = false; // silence every sounding note before the next message
+size_t midi_resets = 0; // bumped by each reset_midi, so the scheduler can rewind its MIDI cursor
+size_t midi_wrap_at = SIZE_MAX, midi_wrap_to = 0; // a queued loop wrap, from and to
+std::vector<MidiMessage> midi_after_wrap; // in sample order, on the clock after the wrap
+bool midi_sounding[16][128] = {}; // notes on at the receiver; callback only
+
+int midi_channel(int audicle) {
+    int ch = audicle % 15;
+    return ch >= MIDI_DRUM_CHANNEL ? ch + 1 : ch;
+}
+
+// The queue_midi* and reset_midi calls expect synth_mutex to be held
+void queue_midi(size_t sample, int status, int data1, int data2) {
+    if (!midi_port) return;
+    MidiMessage m{ sample, { (unsigned char)status, (unsigned char)data1, (unsigned char)data2 } };
+    std::vector<MidiMessage>& queue = midi_wrap_at == SIZE_MAX ? midi_queue : midi_after_wrap;
+    queue.insert(std::upper_bound(queue.begin(), queue.end(), sample,
+        [](size_t s, const MidiMessage& x) { return s < x.sample; }), m);
+}
+
+void queue_midi_note(int audicle, int midi, bool on, size_t sample, int velocity = 0) {
+    if (!midi_port || midi < 0 || midi > 127) return;
+    if (on) midi_held.insert({ audicle, midi });
+    else midi_held.erase({ audicle, midi });
+    if (on && !velocity) velocity = int(config.midi_velocity);
+    queue_midi(sample, (on ? 0x90 : 0x80) | midi_channel(audicle), midi, on ? velocity : 0);
+}
+
+// Drops whatever is queued, silences the receiver and starts `held` afresh at `sample`
+void reset_midi(const HeldNotes& held, size_t sample) {
+    if (!midi_port) return;
+    midi_queue.clear();
+    midi_held.clear();
+    midi_panic = true;
+    ++midi_resets;
+    midi_wrap_at = SIZE_MAX;
+    midi_after_wrap.clear();
+    for (const auto& note : held)
+        queue_midi_note(note.first.first, note.first.second, true, sample, note.second.velocity);
+}
+
+// Queues a loop wrap from `at` to `to`, after which `held` start afresh;
+// everything queued before `at` must already be in
+void wrap_midi(const HeldNotes& held, size_t at, size_t to) {
+    if (!midi_port) return;
+    midi_wrap_at = at;
+    midi_wrap_to = to;
+    midi_held.clear();
+    for (const auto& note : held)
+        queue_midi_note(note.first.first, note.first.second, true, to, note.second.velocity);
+}
+
+static void silence_midi(void* buf, jack_nframes_t offset) {
+    for (int ch = 0; ch < 16; ++ch) {
+        for (int note = 0; note < 128; ++note) {
+            if (!midi_sounding[ch][note]) continue;
+            const jack_midi_data_t off[3] = { jack_midi_data_t(0x80 | ch), jack_midi_data_t(note), 0 };
+            jack_midi_event_write(buf, offset, off, 3);
+            midi_sounding[ch][note] = false;
+        }
     }
-    std::sort(events.begin(), events.end(), [](const ScheduledEvent& a, const ScheduledEvent& b) {
-        if (a.sample_index != b.sample_index) return a.sample_index < b.sample_index;
-        return a.type < b.type;
-        });
 }
 
-// ---- Unified playback and log scheduler ----
-void playback_and_log(const std::vector<ScheduledEvent>& events, size_t total_samples) {
-    size_t event_idx = 0;
-    size_t n_audicles = 0;
-    if (!events.empty()) {
-        for (const auto& ev : events) {
-            if (ev.type == ScheduledEvent::LOG_ROW) {
-                n_audicles = ev.log_cells.size();
+void write_midi(jack_nframes_t nframes) {
+    void* buf = jack_port_get_buffer(midi_port, nframes);
+    jack_midi_clear_buffer(buf);
+    std::lock_guard<std::mutex> lock(synth_mutex);
+    // Signed: after a loop wrap to near 0 the cycle can start before sample 0
+    int64_t start = int64_t(global_playhead_samples.load(std::memory_order_relaxed));
+    if (midi_panic) {
+        silence_midi(buf, 0);
+        midi_panic = false;
+    }
+    size_t sent = 0;
+    bool full = false;
+    for (;;) {
+        int64_t end = std::min(start + int64_t(nframes), midi_wrap_at == SIZE_MAX ? INT64_MAX : int64_t(midi_wrap_at));
+        for (; sent < midi_queue.size() && int64_t(midi_queue[sent].sample) < end; ++sent) {
+            const MidiMessage& m = midi_queue[sent];
+            jack_nframes_t offset = jack_nframes_t(std::max(int64_t(m.sample) - start, int64_t(0)));
+            // A full buffer leaves the rest for the next cycle
+            if (jack_midi_event_write(buf, offset, m.data, 3) != 0) {
+                full = true;
                 break;
             }
+            midi_sounding[m.data[0] & 0x0f][m.data[1]] = (m.data[0] & 0xf0) == 0x90 && m.data[2] > 0;
         }
+        if (full || midi_wrap_at == SIZE_MAX || int64_t(midi_wrap_at) >= start + int64_t(nframes)) break;
+        // The wrap is in this cycle: what was left before it is dropped
+        int64_t offset = std::max(int64_t(midi_wrap_at) - start, int64_t(0));
+        silence_midi(buf, jack_nframes_t(offset));
+        midi_queue.swap(midi_after_wrap);
+        midi_after_wrap.clear();
+        start = int64_t(midi_wrap_to) - offset;
+        midi_wrap_at = SIZE_MAX;
+        sent = 0;
     }
-    // Print header
-    for (size_t a = 0; a < n_audicles; ++a) std::cout << "A" << (a + 1) << " ";
-    std::cout << std::endl;
+    midi_queue.erase(midi_queue.begin(), midi_queue.begin() + sent);
+    metrics.midi_queued.store(midi_queue.size(), std::memory_order_relaxed);
+}
 
-    while (event_idx < events.size()) {
-        size_t playhead = global_playhead_samples.load();
-        while (event_idx < events.size() && events[event_idx].sample_index <= playhead) {
-            const ScheduledEvent& ev = events[event_idx];
-            if (ev.type == ScheduledEvent::NOTE_ON) {
-                trigger_note(ev.audicle_idx, ev.midi, ev.freq, ev.sample_index / double(SAMPLE_RATE));
-            }
-            else if (ev.type == ScheduledEvent::NOTE_OFF) {
-                release_note(ev.audicle_idx, ev.midi, ev.sample_index / double(SAMPLE_RATE));
-            }
-            else if (ev.type == ScheduledEvent::DRUM_ON) {
-                trigger_drum(ev.audicle_idx, ev.drum_type, ev.sample_index / double(SAMPLE_RATE));
-            }
-            else if (ev.type == ScheduledEvent::LOG_ROW) {
-                for (size_t a = 0; a < ev.log_cells.size(); ++a) {
-                    std::cout << std::setw(3) << ev.log_cells[a];
-                }
-                std::cout << " <" << std::endl;
+// Bigger storage for one of the vectors the callback uses, allocated by the
+// playback thread away from synth_mutex
+template <typename T>
+struct Spare {
+    std::vector<T> storage;
+    size_t want = 0; // capacity to allocate before trying again, or 0
+
+    // Under the lock: whether `live` or the spare has room for `need`
+    bool fits(const std::vector<T>& live, size_t need) {
+        bool room = live.capacity() >= need || storage.capacity() >= need;
+        want = room ? 0 : std::max(need, live.capacity() * 2);
+        return room;
+    }
+    void allocate() {
+        if (want) storage.reserve(want);
+    }
+    // Under the lock, once everything fits: copies into the spare and swaps it in
+    void swap_in(std::vector<T>& live, size_t need) {
+        if (live.capacity() >= need) return;
+        storage.assign(live.begin(), live.end());
+        live.swap(storage);
+    }
+};
+
+// Makes room for `events` more queued events, each of which may start a voice
+// and send two MIDI messages, and for the notes of `audicles` audicles. The
+// callback takes synth_mutex too, so nothing is allocated or freed under it:
+// storage is allocated first and only filled and swapped in under the lock.
+void reserve_synth(size_t events, size_t audicles) {
+    Spare<Voice> spare_voices;
+    Spare<uint32_t> spare_free, spare_held;
+    Spare<DrumVoice> spare_drums;
+    Spare<QueuedEvent> spare_queue;
+    Spare<MidiMessage> spare_midi, spare_after_wrap;
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(synth_mutex);
+            size_t queue_need = audio_queue.size() + events;
+            size_t voice_need = voices.size() + queue_need;
+            size_t drum_need = drum_voices.size() + queue_need;
+            size_t midi_need = midi_port ? midi_queue.size() + 2 * events : 0;
+            size_t after_wrap_need = midi_port ? midi_after_wrap.size() + 2 * events : 0;
+            size_t held_need = std::max(held_voice.size(), audicles * 128);
+            // No short-circuiting: each check notes what its vector still needs
+            bool room = spare_voices.fits(voices, voice_need);
+            room &= spare_free.fits(free_voices, voice_need);
+            room &= spare_drums.fits(drum_voices, drum_need);
+            room &= spare_queue.fits(audio_queue, queue_need);
+            room &= spare_midi.fits(midi_queue, midi_need);
+            room &= spare_after_wrap.fits(midi_after_wrap, after_wrap_need);
+            room &= spare_held.fits(held_voice, held_need);
+            if (room) {
+                spare_voices.swap_in(voices, voice_need);
+                spare_free.swap_in(free_voices, voice_need);
+                spare_drums.swap_in(drum_voices, drum_need);
+                spare_queue.swap_in(audio_queue, queue_need);
+                spare_midi.swap_in(midi_queue, midi_need);
+                spare_after_wrap.swap_in(midi_after_wrap, after_wrap_need);
+                spare_held.swap_in(held_voice, held_need);
+                held_voice.resize(held_need, NO_VOICE);
+                break;
             }
-            ++event_idx;
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
-    }
-    // Wait for tail of audio to finish
-    while (global_playhead_samples.load() < total_samples + static_cast<size_t>(RELEASE * SAMPLE_RATE)) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        spare_voices.allocate();
+        spare_free.allocate();
+        spare_drums.allocate();
+        spare_queue.allocate();
+        spare_midi.allocate();
+        spare_after_wrap.allocate();
+        spare_held.allocate();
     }
 }
 
-int main() {
-    std::ifstream infile(MIDA_FILENAME);
-    if (!infile) {
-        std::cerr << "Could not open file: " << MIDA_FILENAME << "\n";
-        return 1;
+// The process callback posts a semaphore at the end of every period, once the
+// new playhead is published, and the playback thread blocks on it rather than
+// polling. sem_post never blocks or allocates, so it is safe on the audio
+// thread. The timeout keeps commands serviced should the callback stop
+// running; where there are no POSIX semaphores this falls back to a 1 ms poll.
+class PeriodWakeup {
+public:
+#ifdef __linux__
+    PeriodWakeup() { sem_init(&sem, 0, 0); }
+    ~PeriodWakeup() { sem_destroy(&sem); }
+    void post() { sem_post(&sem); }
+
+    // Periods missed while the caller was busy are folded into this wakeup
+    void wait(std::chrono::milliseconds timeout) {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += long(timeout.count() % 1000) * 1000000;
+        deadline.tv_sec += time_t(timeout.count() / 1000 + deadline.tv_nsec / 1000000000);
+        deadline.tv_nsec %= 1000000000;
+        while (sem_timedwait(&sem, &deadline) != 0 && errno == EINTR) {}
+        while (sem_trywait(&sem) == 0) {}
     }
-    std::string corpus((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
 
-    std::vector<Audicle> audicles = parse_mida_file(corpus);
+private:
+    sem_t sem;
+#else
+    void post() {}
+    void wait(std::chrono::milliseconds) { std::this_thread::sleep_for(std::chrono::milliseconds(1)); }
+#endif
+};
 
-    std::vector<ScheduledEvent> events;
-    size_t total_samples = 0;
-    schedule_events_and_log(audicles, events, total_samples);
+PeriodWakeup period_wakeup;
 
-    jack_client_t* client = jack_client_open("mida", JackNullOption, nullptr);
-    if (!client) { std::cerr << "Could not open JACK client.\n"; return 1; }
-    jack_port_t* output_port = jack_port_register(client, "out", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
-    if (!output_port) { std::cerr << "Could not register JACK port.\n"; return 1; }
-    jack_set_process_callback(client, [](jack_nframes_t nframes, void* arg) {
-        return jack_callback(nframes, arg);
-        }, output_port);
-    if (jack_activate(client)) { std::cerr << "Cannot activate JACK client.\n"; return 1; }
+int jack_callback(jack_nframes_t nframes, void* arg) {
+    auto began = std::chrono::steady_clock::now();
+    TRACE_THREAD("process");
+    TRACE(TRACE_CALLBACK_BEGIN, 0, 0, global_playhead_samples.load(std::memory_order_relaxed));
+#ifdef MIDA_TRACE
+    // The xrun callback may run on a thread without a ring, so xruns are
+    // recorded here, at the start of the next period
+    static size_t xruns_traced = 0;
+    for (size_t xruns = metrics.xruns.load(std::memory_order_relaxed); xruns_traced < xruns; ++xruns_traced)
+        TRACE(TRACE_XRUN, 0, 0, 0);
+#endif
+    period_frames.store(nframes, std::memory_order_relaxed);
+    float* out = (float*)jack_port_get_buffer((jack_port_t*)arg, nframes);
+    bool rolling = true;
+    if (transport_client) {
+        jack_position_t pos;
+        rolling = jack_transport_query(transport_client, &pos) == JackTransportRolling;
+        if (pos.frame != global_playhead_samples.load(std::memory_order_relaxed)) {
+            if (rolling) transport_located.store(true);
+            global_playhead_samples.store(pos.frame, std::memory_order_release);
+            // What was queued for the old position must not play at the new one
+            locate_generation.fetch_add(1, std::memory_order_release);
+        }
+        transport_rolling.store(rolling);
+    }
+    if (midi_port) write_midi(nframes);
+    // Stopped: the playhead stands still while released notes ring out
+    render_block(out, nframes, rolling);
 
-    const char** ports = jack_get_ports(client, nullptr, JACK_DEFAULT_AUDIO_TYPE, JackPortIsPhysical | JackPortIsInput);
-    if (ports && ports[0]) {
-        if (jack_connect(client, jack_port_name(output_port), ports[0]) != 0)
-            std::cerr << "Failed to connect to " << ports[0] << "\n";
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - began).count();
+    double rate = playback_sample_rate.load(std::memory_order_relaxed);
+    double load = rate > 0 ? ns * 1e-9 * rate / nframes : 0;
+    metrics.callbacks.fetch_add(1, std::memory_order_relaxed);
+    metrics.callback_ns.fetch_add(ns, std::memory_order_relaxed);
+    metrics.frames.fetch_add(nframes, std::memory_order_relaxed);
+    if (load > metrics.callback_load_peak.load(std::memory_order_relaxed))
+        metrics.callback_load_peak.store(load, std::memory_order_relaxed);
+    TRACE(TRACE_CALLBACK_END, 0, metrics.drum_voices.load(std::memory_order_relaxed), metrics.voices.load(std::memory_order_relaxed));
+    period_wakeup.post();
+    return 0;
+}
+
+int jack_xrun_callback(void*) {
+    metrics.xruns.fetch_add(1, std::memory_order_relaxed);
+    return 0;
+}
+
+// Events applied straight from the playback thread are applied once the
+// playhead has passed them. Callers hold synth_mutex, so the playhead cannot
+// move underneath them.
+static size_t samples_late(size_t sample_index) {
+    size_t playhead = global_playhead_samples.load(std::memory_order_acquire);
+    return playhead > sample_index ? playhead - sample_index : 0;
+}
+
+void trigger_note(int audicle, int midi, double freq, size_t sample_index, int velocity = 0) {
+    std::lock_guard<std::mutex> lock(synth_mutex);
+    start_voice(audicle, midi, freq, samples_late(sample_index), velocity);
+}
+
+void release_note(int audicle, int midi, size_t sample_index) {
+    std::lock_guard<std::mutex> lock(synth_mutex);
+    release_voices(audicle, midi, samples_late(sample_index));
+}
+
+void trigger_drum(int audicle, DrumKind kind, size_t sample_index) {
+    std::lock_guard<std::mutex> lock(synth_mutex);
+    start_drum_voice(audicle, kind, samples_late(sample_index));
+}
+
+// Jumps the playhead to `sample`. Whatever is sounding is released, and the
+// notes held across that point restart with their clocks set from their
+// NOTE_ON, so they come back in the envelope stage they would have reached.
+// When JACK transport drives the playhead it is already there: pass false.
+void seek_engine(size_t sample, const HeldNotes& held, bool move_playhead = true) {
+    reserve_synth(held.size(), 0);
+    {
+        std::lock_guard<std::mutex> lock(synth_mutex);
+        release_all_voices(0);
+        audio_queue.clear();
+        if (move_playhead) global_playhead_samples.store(sample, std::memory_order_release);
+        reset_midi(held, sample);
+    }
+    for (const auto& note : held)
+        trigger_note(note.first.first, note.first.second, midiToFreq(note.first.second), note.second.since, note.second.velocity);
+}
+
+// Switches the engine to tables built for a new rate. The playhead and the
+// running voices are rescaled so playback carries on from the same musical
+// position, and events queued at the old rate are dropped to be queued again
+// from the playhead; the old tables come back in `tables` to be freed outside
+// the lock. Returns the rescaled playhead.
+size_t change_sample_rate(std::unique_ptr<SynthTables>& tables) {
+    std::lock_guard<std::mutex> lock(synth_mutex);
+    double ratio = tables->sample_rate / synth_tables->sample_rate;
+    size_t playhead = static_cast<size_t>(std::llround(global_playhead_samples.load(std::memory_order_relaxed) * ratio));
+    global_playhead_samples.store(playhead, std::memory_order_release);
+    for (Voice& v : voices) {
+        v.elapsed = static_cast<size_t>(std::llround(v.elapsed * ratio));
+        v.phase_inc = (v.midi >= 0 && v.midi < 128) ? tables->phase_inc[v.midi] : 2 * M_PI * v.freq * tables->inv_sample_rate;
+    }
+    for (DrumVoice& v : drum_voices)
+        v.elapsed = static_cast<size_t>(std::llround(v.elapsed * ratio));
+    audio_queue.clear();
+    std::swap(synth_tables, tables);
+    return playhead;
+}
+
+int jack_sample_rate_callback(jack_nframes_t nframes, void*) {
+    pending_sample_rate.store(nframes);
+    return 0;
+}
+
+// ---- Event Scheduling ----
+struct ScheduledEvent {
+    size_t sample_index;
+    enum Type { NOTE_ON, NOTE_OFF, DRUM_ON } type;
+    int midi; // DRUM_ON: the audicle's @drum_note, or -1
+    int audicle_idx;
+    double freq;
+    DrumKind drum; // DRUM_ON: which set of drum types it was struck with
+    int velocity; // 1-127 when played from a MIDI file, 0 for MIDA's default
+};
+
+// At one sample, note offs go first: a note that ends where the next play of
+// its section strikes it again must be released before it is restarted
+int event_order(ScheduledEvent::Type type) {
+    return type == ScheduledEvent::NOTE_OFF ? 0 : type == ScheduledEvent::NOTE_ON ? 1 : 2;
+}
+
+// ---- Tempo map and step grid ----
+// Every scheduled position is a sixteenth step, or a fraction of one, looked up
+// in a table of sample indices built once per tempo map and sample rate. The
+// table is accumulated in exact integer fractions, so an hour-long set ends on
+// the same sample a single multiplication would give.
+struct StepGrid {
+    std::vector<size_t> sample_at; // sample index of every sixteenth, plus the end
+    size_t steps_per_bar = 16;
+
+    // Sample index of the position num/den sixteenths into the song
+    size_t sample(size_t num, size_t den) const {
+        size_t q = num / den, r = num % den;
+        if (q + 1 >= sample_at.size()) return sample_at.back();
+        return sample_at[q] + (sample_at[q + 1] - sample_at[q]) * r / den;
+    }
+};
+
+StepGrid build_step_grid(const TempoMap& tempo, double bpm, double sample_rate, size_t steps) {
+    StepGrid grid;
+    grid.steps_per_bar = tempo.steps_per_bar;
+    grid.sample_at.resize(steps + 1);
+    // One sixteenth lasts 15 * rate / bpm samples; with bpm in thousandths that
+    // is the fraction num / den. The straight position is whole + rem / den.
+    const uint64_t num = 15 * 1000 * static_cast<uint64_t>(std::llround(sample_rate));
+    uint64_t den = static_cast<uint64_t>(std::llround(bpm * 1000));
+    uint64_t whole = 0, rem = 0;
+    long long swing_offset = 0;
+    size_t change = 0;
+    for (size_t step = 0; step <= steps; ++step) {
+        bool tempo_changed = step == 0;
+        while (change < tempo.changes.size() && tempo.changes[change].step <= step) {
+            uint64_t new_den = static_cast<uint64_t>(std::llround(tempo.changes[change].bpm * 1000));
+            rem = rem * new_den / den;
+            den = new_den;
+            tempo_changed = true;
+            ++change;
+        }
+        if (tempo_changed) {
+            // Odd sixteenths are pushed late by the swing share of the current pair
+            swing_offset = std::llround((tempo.swing - 50.0) / 50.0 * double(num) / double(den));
+        }
+        // Entries depend only on their step, so grids of different lengths agree
+        size_t straight = static_cast<size_t>(whole + (2 * rem >= den ? 1 : 0));
+        grid.sample_at[step] = step % 2 ? static_cast<size_t>(static_cast<long long>(straight) + swing_offset) : straight;
+        whole += num / den;
+        rem += num % den;
+        if (rem >= den) {
+            whole += 1;
+            rem -= den;
+        }
+    }
+    return grid;
+}
+
+// One audicle's share of a schedule, run by run of its timeline: the events
+// of each run in time order, and the log cell of each step of its pattern.
+// Events are timed in the audicle's own steps (sample_index holds the step) so
+// one schedule serves every repetition, and every play of its section; the
+// merge places them on the grid.
+//
+// A run's first repetition has events of its own, since it starts from whatever
+// the previous run left sounding. The later ones all share one list: a pattern
+// with any note or rest in it ends in the same state however it began, and one
+// of nothing but holds keeps the state it was given.
+struct ScheduleRun {
+    size_t start; // first step
+    size_t steps; // per repetition
+    size_t repeats;
+    std::vector<ScheduledEvent> first_events; // timed from `start`
+    std::vector<ScheduledEvent> repeat_events; // timed from each later repetition's start
+    std::vector<std::string> cells; // one per Step of the pattern
+    std::vector<size_t> cell_start; // where each cell begins in a repetition
+};
+
+struct AudicleSchedule {
+    std::vector<ScheduleRun> runs;
+    size_t steps = 0;
+
+    // The log cell at `step`, or null past the end
+    const std::string* cell(size_t step) const {
+        if (step >= steps) return nullptr;
+        auto run = std::upper_bound(runs.begin(), runs.end(), step, [](size_t s, const ScheduleRun& r) { return s < r.start; }) - 1;
+        size_t at = (step - run->start) % run->steps;
+        return &run->cells[std::upper_bound(run->cell_start.begin(), run->cell_start.end(), at) - run->cell_start.begin() - 1];
+    }
+
+    size_t event_count() const {
+        size_t n = 0;
+        for (const ScheduleRun& run : runs)
+            n += run.first_events.size() + (run.repeats - 1) * run.repeat_events.size();
+        return n;
+    }
+};
+
+// Walks a schedule's events in time order, repetitions expanded. Repetitions
+// without events are skipped whole, so a long hold costs nothing.
+struct ScheduleCursor {
+    const AudicleSchedule* sched;
+    size_t run = 0, rep = 0, idx = 0;
+
+    const std::vector<ScheduledEvent>& list() const {
+        const ScheduleRun& r = sched->runs[run];
+        return rep ? r.repeat_events : r.first_events;
+    }
+    bool valid() const { return run < sched->runs.size(); }
+    const ScheduledEvent& event() const { return list()[idx]; }
+    size_t step() const {
+        const ScheduleRun& r = sched->runs[run];
+        return r.start + rep * r.steps + event().sample_index;
+    }
+
+    // Moves to the next event at or after the current position
+    void settle() {
+        while (valid() && idx >= list().size()) {
+            const ScheduleRun& r = sched->runs[run];
+            idx = 0;
+            if (rep + 1 < r.repeats && !r.repeat_events.empty()) {
+                ++rep;
+            }
+            else {
+                rep = 0;
+                ++run;
+            }
+        }
+    }
+    void next() {
+        ++idx;
+        settle();
+    }
+};
+
+// Length of an audicle in sixteenths, rounded up
+size_t audicle_steps(const Audicle& au) {
+    return (au.timeline.size() * au.step_num + au.step_den - 1) / au.step_den;
+}
+
+std::string cell_text(const std::vector<std::string>& notes, bool is_drum) {
+    std::string cell;
+    if (is_drum) {
+        if (notes.empty())
+            cell = "_";
+        else if (notes.size() == 1)
+            cell = notes[0];
+        else {
+            cell = "{";
+            for (size_t n = 0; n < notes.size(); ++n) {
+                if (n) cell += " ";
+                cell += notes[n];
+            }
+            cell += "}";
+        }
+    }
+    else {
+        if (notes.empty()) cell = ".";
+        else if (notes.size() == 1) cell = notes[0];
+        else {
+            for (size_t n = 0; n < notes.size(); ++n) {
+                if (n) cell += "~";
+                cell += notes[n];
+            }
+        }
+    }
+    return cell;
+}
+
+// The pitches sounding in a melodic audicle, one bit per MIDI note. What starts
+// and stops between two steps is a mask difference, walked lowest note first.
+// Index of the lowest set bit of a nonzero word
+inline int lowest_bit(uint64_t b) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward64(&i, b);
+    return int(i);
+#else
+    return __builtin_ctzll(b);
+#endif
+}
+
+struct NoteMask {
+    uint64_t bits[2] = { 0, 0 };
+
+    void set(int midi) { bits[midi >> 6] |= uint64_t(1) << (midi & 63); }
+    bool empty() const { return (bits[0] | bits[1]) == 0; }
+    NoteMask without(const NoteMask& o) const {
+        NoteMask m;
+        m.bits[0] = bits[0] & ~o.bits[0];
+        m.bits[1] = bits[1] & ~o.bits[1];
+        return m;
+    }
+    template <typename F>
+    void for_each(F f) const {
+        for (int w = 0; w < 2; ++w)
+            for (uint64_t b = bits[w]; b; b &= b - 1) f(w * 64 + lowest_bit(b));
+    }
+};
+
+AudicleSchedule schedule_audicle(const Audicle& au, int a) {
+    AudicleSchedule sched;
+    bool is_drum = au.is_drum;
+    NoteMask prev_midi;
+    // Appends the events of one step, `at` steps into its repetition
+    auto play_step = [&](const std::vector<std::string>& notes, size_t at, std::vector<ScheduledEvent>& events) {
+        if (is_drum) {
+            for (size_t n = 0; n < notes.size(); ++n) {
+                if (notes[n] != "_") {
+                    events.push_back({ at, ScheduledEvent::DRUM_ON, au.drum_note, a, 0.0, drum_kind(notes[n]), 0 });
+                }
+            }
+            return;
+        }
+        // A hold keeps sounding what the last step struck, which is prev_midi
+        if (notes.size() == 1 && notes[0] == "-") return;
+        NoteMask current_midi;
+        for (size_t i = 0; i < notes.size(); ++i) {
+            int midi = noteNameToMidi(notes[i]);
+            if (midi > 0 && midi < 128) current_midi.set(midi);
+        }
+        current_midi.without(prev_midi).for_each([&](int midi) {
+            events.push_back({ at, ScheduledEvent::NOTE_ON, midi, a, midiToFreq(midi), DRUM_PLAIN, 0 });
+            });
+        prev_midi.without(current_midi).for_each([&](int midi) {
+            events.push_back({ at, ScheduledEvent::NOTE_OFF, midi, a, midiToFreq(midi), DRUM_PLAIN, 0 });
+            });
+        prev_midi = current_midi;
+    };
+    auto by_time = [](const ScheduledEvent& x, const ScheduledEvent& y) {
+        if (x.sample_index != y.sample_index) return x.sample_index < y.sample_index;
+        return event_order(x.type) < event_order(y.type);
+    };
+
+    size_t start = 0;
+    for (const TimelineRun& tr : au.timeline.runs) {
+        ScheduleRun run{ start, tr.length, tr.repeats, {}, {}, {}, {} };
+        size_t at = 0;
+        for (const Step& step : tr.steps) {
+            run.cells.push_back(cell_text(step.notes, is_drum));
+            run.cell_start.push_back(at);
+            play_step(step.notes, at, run.first_events);
+            at += step.length;
+        }
+        if (tr.repeats > 1) {
+            at = 0;
+            for (const Step& step : tr.steps) {
+                play_step(step.notes, at, run.repeat_events);
+                at += step.length;
+            }
+        }
+        std::stable_sort(run.first_events.begin(), run.first_events.end(), by_time);
+        std::stable_sort(run.repeat_events.begin(), run.repeat_events.end(), by_time);
+        start += tr.length * tr.repeats;
+        sched.runs.push_back(std::move(run));
+    }
+    sched.steps = start;
+    // Schedule note offs at the end
+    if (!prev_midi.empty()) {
+        ScheduleRun end{ start, 0, 1, {}, {}, {}, {} };
+        prev_midi.for_each([&](int midi) {
+            end.first_events.push_back({ 0, ScheduledEvent::NOTE_OFF, midi, a, midiToFreq(midi), DRUM_PLAIN, 0 });
+            });
+        sched.runs.push_back(std::move(end));
+    }
+    return sched;
+}
+
+// ---- Standard MIDI File reader ----
+// Native replacement for midi_to_mida.py. The file is memory-mapped and each
+// MTrk chunk is decoded in one streaming pass, keeping only its note events.
+struct SmfNote {
+    uint64_t tick; // absolute
+    uint8_t channel;
+    uint8_t note;
+    uint8_t velocity;
+    bool on; // note-on with a non-zero velocity
+};
+
+struct SmfTempo {
+    uint64_t tick;
+    uint32_t usec_per_beat;
+};
+
+struct SmfFile {
+    int format = 0;
+    uint64_t ticks_per_beat = 0;
+    std::vector<std::vector<SmfNote>> tracks;
+    std::vector<SmfTempo> tempos; // from every track, in tick order
+    int meter_num = 0; // first time signature, if any
+    int meter_den = 0;
+};
+
+struct MappedFile {
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+    std::string contents; // used where mmap is not available
+
+    bool open(const std::string& path) {
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) close(fd);
+            std::cerr << "Could not open file: " << path << "\n";
+            return false;
+        }
+        size = size_t(st.st_size);
+        void* p = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+        close(fd);
+        if (p == MAP_FAILED) {
+            std::cerr << "Could not map file: " << path << "\n";
+            return false;
+        }
+        if (p) madvise(p, size, MADV_SEQUENTIAL);
+        data = static_cast<const unsigned char*>(p);
+        return true;
+#else
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            std::cerr << "Could not open file: " << path << "\n";
+            return false;
+        }
+        contents.assign((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        data = reinterpret_cast<const unsigned char*>(contents.data());
+        size = contents.size();
+        return true;
+#endif
+    }
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (data && size) munmap(const_cast<unsigned char*>(data), size);
+#endif
+    }
+};
+
+static uint32_t read_be(const unsigned char* p, int bytes) {
+    uint32_t v = 0;
+    for (int i = 0; i < bytes; ++i) v = (v << 8) | p[i];
+    return v;
+}
+
+// Decodes one MTrk chunk. Running status follows mido, which the Python
+// converter used: meta events leave it alone, sysex replaces it.
+static bool read_smf_track(const unsigned char* p, const unsigned char* end, SmfFile& smf, std::vector<SmfNote>& notes, std::string& error) {
+    uint64_t tick = 0;
+    int status = 0;
+    auto vlq = [&](uint32_t& v) {
+        v = 0;
+        for (int i = 0; i < 4 && p < end; ++i) {
+            v = (v << 7) | (*p & 0x7f);
+            if (!(*p++ & 0x80)) return true;
+        }
+        return false;
+    };
+    while (p < end) {
+        uint32_t delta, len;
+        if (!vlq(delta)) { error = "bad delta time"; return false; }
+        tick += delta;
+        if (p >= end) { error = "truncated event"; return false; }
+        int byte = *p;
+        if (byte >= 0x80) {
+            ++p;
+            if (byte != 0xff) status = byte;
+        }
+        else if (status == 0 || status >= 0xf0) {
+            error = "running status without a channel status";
+            return false;
+        }
+        else {
+            byte = status;
+        }
+        if (byte == 0xff) {
+            if (p >= end) { error = "truncated meta event"; return false; }
+            int type = *p++;
+            if (!vlq(len) || len > size_t(end - p)) { error = "truncated meta event"; return false; }
+            if (type == 0x51 && len == 3) {
+                smf.tempos.push_back({ tick, read_be(p, 3) });
+            }
+            else if (type == 0x58 && len >= 2 && !smf.meter_den && p[1] <= 6) {
+                smf.meter_num = p[0];
+                smf.meter_den = 1 << p[1];
+            }
+            p += len;
+        }
+        else if (byte == 0xf0 || byte == 0xf7) {
+            if (!vlq(len) || len > size_t(end - p)) { error = "truncated sysex"; return false; }
+            p += len;
+        }
+        else if (byte >= 0xf0) {
+            error = "unexpected system message";
+            return false;
+        }
+        else {
+            int kind = byte & 0xf0;
+            size_t n = (kind == 0xc0 || kind == 0xd0) ? 1 : 2;
+            if (size_t(end - p) < n || p[0] > 0x7f || (n == 2 && p[1] > 0x7f)) { error = "bad channel message"; return false; }
+            if (kind == 0x80 || kind == 0x90)
+                notes.push_back({ tick, uint8_t(byte & 0x0f), p[0], p[1], kind == 0x90 && p[1] > 0 });
+            p += n;
+        }
+    }
+    return true;
+}
+
+bool read_smf(const std::string& path, SmfFile& smf) {
+    MappedFile file;
+    if (!file.open(path)) return false;
+    const unsigned char* p = file.data;
+    const unsigned char* end = p + file.size;
+    if (file.size < 14 || std::memcmp(p, "MThd", 4) != 0 || read_be(p + 4, 4) < 6) {
+        std::cerr << path << ": not a standard MIDI file\n";
+        return false;
+    }
+    smf.format = int(read_be(p + 8, 2));
+    uint32_t division = read_be(p + 12, 2);
+    if (division & 0x8000) {
+        std::cerr << path << ": SMPTE time division is not supported\n";
+        return false;
+    }
+    smf.ticks_per_beat = division;
+    smf.tracks.clear();
+    smf.tempos.clear();
+    p += 8 + read_be(p + 4, 4);
+    while (end - p >= 8) {
+        uint32_t len = read_be(p + 4, 4);
+        const unsigned char* body = p + 8;
+        const unsigned char* chunk_end = len > size_t(end - body) ? end : body + len;
+        if (std::memcmp(p, "MTrk", 4) == 0) {
+            smf.tracks.emplace_back();
+            std::string error;
+            if (!read_smf_track(body, chunk_end, smf, smf.tracks.back(), error)) {
+                std::cerr << path << ": track " << smf.tracks.size() << ": " << error << "\n";
+                return false;
+            }
+        }
+        p = chunk_end;
+    }
+    std::stable_sort(smf.tempos.begin(), smf.tempos.end(), [](const SmfTempo& a, const SmfTempo& b) { return a.tick < b.tick; });
+    return true;
+}
+
+// ---- MIDI to MIDA conversion ----
+// Same rules as midi_to_mida.py:
+// - every channel 10 hit becomes a drum audicle per GM note, in eighths, with
+//   velocity as the type set (^| >= 110, v| <= 40, *| otherwise); the note is
+//   kept as an @drum_note for --midi-out
+// - every other track becomes a melodic audicle in sixteenths, where a slot
+//   holds the notes sounding at its end and a repeated chord becomes a hold
+// Several audicles are wrapped in the same `~# / ‘ markers.
+std::string midi_note_name(int note) {
+    static const char* names[] = { "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B" };
+    return names[note % 12] + std::to_string(note / 12 - 1);
+}
+
+static const char* velocity_type_set(int velocity) {
+    return velocity >= 110 ? "^|" : velocity <= 40 ? "v|" : "*|";
+}
+
+// (GM note, audicle line) per drum, in note order
+std::vector<std::pair<int, std::string>> smf_drum_audicles(const SmfFile& smf) {
+    std::map<int, std::vector<std::pair<uint64_t, int>>> hits; // note -> (tick, velocity)
+    uint64_t total_ticks = 0;
+    for (const auto& track : smf.tracks) {
+        for (const SmfNote& n : track) {
+            if (!n.on || n.channel != 9) continue;
+            hits[n.note].push_back({ n.tick, n.velocity });
+            total_ticks = std::max(total_ticks, n.tick);
+        }
+    }
+    std::vector<std::pair<int, std::string>> lines;
+    const uint64_t eighth = smf.ticks_per_beat / 2;
+    const size_t slots = size_t((total_ticks + eighth - 1) / eighth + 1);
+    for (const auto& drum : hits) {
+        std::vector<std::vector<int>> timeline(slots);
+        for (const auto& hit : drum.second) timeline[hit.first / eighth].push_back(hit.second);
+        while (!timeline.empty() && timeline.back().empty()) timeline.pop_back();
+        if (timeline.empty()) continue;
+        std::string line = "(";
+        for (size_t i = 0; i < timeline.size(); ++i) {
+            const std::vector<int>& v = timeline[i];
+            if (i) line += ' ';
+            if (v.empty()) line += '_';
+            else if (v.size() == 1) line += velocity_type_set(v[0]);
+            else {
+                line += '{';
+                for (size_t k = 0; k < v.size(); ++k) {
+                    if (k) line += ' ';
+                    line += velocity_type_set(v[k]);
+                }
+                line += '}';
+            }
+        }
+        lines.push_back({ drum.first, line + ")" });
+    }
+    return lines;
+}
+
+std::string smf_melodic_audicle(const std::vector<SmfNote>& notes, uint64_t sixteenth) {
+    if (notes.empty()) return "";
+    uint64_t total_ticks = 0;
+    for (const SmfNote& n : notes) total_ticks = std::max(total_ticks, n.tick);
+    const size_t slots = size_t((total_ticks + sixteenth - 1) / sixteenth + 1);
+    std::vector<std::string> tokens;
+    tokens.reserve(slots);
+    std::set<int> active, prev;
+    size_t i = 0;
+    for (size_t slot = 0; slot < slots; ++slot) {
+        uint64_t slot_end = (slot + 1) * sixteenth;
+        for (; i < notes.size() && notes[i].tick < slot_end; ++i) {
+            if (notes[i].on) active.insert(notes[i].note);
+            else active.erase(notes[i].note);
+        }
+        if (active.empty()) {
+            tokens.push_back(".");
+        }
+        else if (active == prev) {
+            tokens.push_back("-");
+        }
+        else {
+            std::string token;
+            for (int note : active) {
+                if (!token.empty()) token += '~';
+                token += midi_note_name(note);
+            }
+            tokens.push_back(token);
+        }
+        prev = active;
+    }
+    while (!tokens.empty() && tokens.back() == ".") tokens.pop_back();
+    if (tokens.empty()) return "";
+    std::string line = "*";
+    for (size_t t = 0; t < tokens.size(); ++t) {
+        if (t) line += ' ';
+        line += tokens[t];
+    }
+    return line + "*";
+}
+
+// Which audicle of the converted text each part of a MIDI file became
+struct SmfLayout {
+    std::map<int, int> drum_audicle; // GM note -> audicle
+    std::vector<int> track_audicle; // per track; -1 for drum tracks and tracks with nothing to show
+};
+
+// The MIDA text of a whole file, or an empty string when it cannot be converted
+std::string smf_to_mida(const SmfFile& smf, const std::string& path, SmfLayout* layout = nullptr) {
+    if (smf.ticks_per_beat < 4) {
+        std::cerr << path << ": " << smf.ticks_per_beat << " ticks per beat is too coarse for sixteenths\n";
+        return "";
+    }
+    std::vector<std::pair<int, std::string>> drums = smf_drum_audicles(smf);
+    std::vector<std::string> melodic;
+    std::vector<int> track_audicle(smf.tracks.size(), -1);
+    for (size_t t = 0; t < smf.tracks.size(); ++t) {
+        const std::vector<SmfNote>& track = smf.tracks[t];
+        bool is_drum = std::any_of(track.begin(), track.end(), [](const SmfNote& n) { return n.channel == 9; });
+        if (is_drum) continue;
+        std::string line = smf_melodic_audicle(track, smf.ticks_per_beat / 4);
+        if (line.empty()) continue;
+        track_audicle[t] = int(drums.size() + melodic.size());
+        melodic.push_back(line);
+    }
+    if (layout) {
+        layout->drum_audicle.clear();
+        for (size_t d = 0; d < drums.size(); ++d) layout->drum_audicle[drums[d].first] = int(d);
+        layout->track_audicle = track_audicle;
+    }
+    size_t count = drums.size() + melodic.size();
+    std::string out;
+    if (count > 1) out += "`~#\n\xe2\x80\x98\n";
+    for (const auto& drum : drums) out += "@drum_note " + std::to_string(drum.first) + "\n" + drum.second + "\n";
+    for (const std::string& line : melodic) out += line + "\n";
+    if (count == 0) out += "// No tracks found.\n";
+    else if (count > 1) out += "\xe2\x80\x98\n";
+    return out;
+}
+
+// ---- Programs and hot reload ----
+// One parsed and scheduled version of the MIDA file. playback_and_log owns the
+// program it plays; with --watch, a watcher thread builds replacements on every
+// save and publishes them with a single pointer exchange. The playback thread
+// adopts the newest one at the next bar line and hands the old one back to the
+// watcher to free, so the scheduler never pays for tearing a program down.
+
+// A MIDI file played at its own timing, with the layout of its MIDA view
+struct SmfSource {
+    SmfFile file;
+    SmfLayout layout;
+};
+
+// One play of a section, as the log needs it
+struct SectionPlay {
+    size_t start; // sixteenth the play begins on
+    size_t first; // the section's audicles are [first, first + count)
+    size_t count;
+};
+
+struct Program {
+    std::vector<std::shared_ptr<const Audicle>> audicles;
+    std::vector<std::shared_ptr<const AudicleSchedule>> schedules; // one per audicle, shared by its section's plays
+    TempoMap tempo;
+    SongForm form;
+    std::vector<SectionPlay> plays;
+    StepGrid grid;
+    std::vector<ScheduledEvent> events; // every audicle's events; log rows are printed off the grid
+    std::vector<HeldNotes> held_at_bar; // notes sounding across each bar line, for seeking
+    std::shared_ptr<const SmfSource> smf; // set when events come straight from a MIDI file
+    bool compiled = false; // loaded from a .midc file, so there is no source to reschedule
+    size_t log_rows = 0;
+    size_t total_samples = 0;
+    double sample_rate = 0;
+};
+
+// Audicle schedules from the last build. They are timed in steps, so tempo and
+// rate changes leave them valid. Unchanged lines keep their Audicle object across
+// parses, so they are found here by address and only edited audicles are rescheduled.
+struct ScheduleCache {
+    std::unordered_map<const Audicle*, std::pair<std::shared_ptr<const Audicle>, std::shared_ptr<const AudicleSchedule>>> audicles;
+    size_t reused = 0; // schedules taken from the cache by the last build
+};
+
+// Checkpoint the held notes at every bar line, so a seek replays at most a bar
+void index_held_notes(Program& prog) {
+    const size_t max_steps = prog.log_rows;
+    const size_t spb = prog.grid.steps_per_bar;
+    HeldNotes held;
+    size_t bar_step = 0;
+    prog.held_at_bar.clear();
+    for (const ScheduledEvent& ev : prog.events) {
+        for (; bar_step <= max_steps && prog.grid.sample_at[bar_step] <= ev.sample_index; bar_step += spb)
+            prog.held_at_bar.push_back(held);
+        if (ev.type == ScheduledEvent::NOTE_ON) held[{ ev.audicle_idx, ev.midi }] = { ev.sample_index, ev.velocity };
+        else if (ev.type == ScheduledEvent::NOTE_OFF) held.erase({ ev.audicle_idx, ev.midi });
+    }
+    for (; bar_step <= max_steps; bar_step += spb)
+        prog.held_at_bar.push_back(held);
+}
+
+// Seconds at a (fractional) tick of a MIDI file, through its tempo changes.
+// Each segment is timed from its own start, so rounding never accumulates.
+struct SmfClock {
+    const std::vector<SmfTempo>& tempos;
+    std::vector<double> start; // seconds at each tempo change
+    double ticks_per_beat;
+
+    SmfClock(const SmfFile& smf) : tempos(smf.tempos), ticks_per_beat(double(smf.ticks_per_beat)) {
+        for (size_t i = 0; i < tempos.size(); ++i)
+            start.push_back(i ? start[i - 1] + (tempos[i].tick - tempos[i - 1].tick) * tempos[i - 1].usec_per_beat / (1e6 * ticks_per_beat)
+                              : tempos[0].tick * 0.5 / ticks_per_beat);
+    }
+
+    double seconds(double tick) const {
+        size_t i = std::upper_bound(tempos.begin(), tempos.end(), tick,
+            [](double t, const SmfTempo& c) { return t < double(c.tick); }) - tempos.begin();
+        if (i == 0) return tick * 0.5 / ticks_per_beat; // 120 bpm until the first tempo
+        --i;
+        return start[i] + (tick - tempos[i].tick) * tempos[i].usec_per_beat / (1e6 * ticks_per_beat);
+    }
+};
+
+// Events straight from the MIDI file: every note at its own tick and velocity,
+// under the file's tempo map. The log still shows the quantized MIDA view, one
+// row per sixteenth of the same clock.
+void schedule_smf_events(Program& prog, double sample_rate) {
+    const SmfFile& smf = prog.smf->file;
+    const SmfLayout& layout = prog.smf->layout;
+    const SmfClock clock(smf);
+    auto sample_at_tick = [&](double tick) { return static_cast<size_t>(std::llround(clock.seconds(tick) * sample_rate)); };
+
+    size_t n_aud = prog.audicles.size();
+    uint64_t last_tick = 0;
+    for (const auto& track : smf.tracks)
+        if (!track.empty()) last_tick = std::max(last_tick, track.back().tick);
+    size_t max_steps = size_t((last_tick * 4 + smf.ticks_per_beat - 1) / smf.ticks_per_beat);
+    for (size_t i = 0; i < n_aud; ++i) max_steps = std::max(max_steps, audicle_steps(*prog.audicles[i]));
+    prog.plays.assign(1, { 0, 0, n_aud });
+    prog.sample_rate = sample_rate;
+    prog.log_rows = max_steps;
+    prog.grid.steps_per_bar = prog.tempo.steps_per_bar;
+    prog.grid.sample_at.resize(max_steps + 1);
+    for (size_t step = 0; step <= max_steps; ++step)
+        prog.grid.sample_at[step] = sample_at_tick(step * clock.ticks_per_beat / 4);
+    prog.total_samples = prog.grid.sample_at[max_steps];
+
+    // Only the cells are kept; the notes come from the file
+    prog.schedules.assign(n_aud, nullptr);
+    for (size_t a = 0; a < n_aud; ++a) {
+        AudicleSchedule sched = schedule_audicle(*prog.audicles[a], (int)a);
+        for (ScheduleRun& run : sched.runs) run.first_events = run.repeat_events = {};
+        prog.schedules[a] = std::make_shared<const AudicleSchedule>(std::move(sched));
+    }
+
+    prog.events.clear();
+    for (size_t t = 0; t < smf.tracks.size(); ++t) {
+        int melodic = t < layout.track_audicle.size() ? layout.track_audicle[t] : -1;
+        for (const SmfNote& n : smf.tracks[t]) {
+            size_t sample = sample_at_tick(double(n.tick));
+            if (n.channel == 9) {
+                auto drum = layout.drum_audicle.find(n.note);
+                if (n.on && drum != layout.drum_audicle.end())
+                    prog.events.push_back({ sample, ScheduledEvent::DRUM_ON, n.note, drum->second, 0.0, drum_kind(velocity_type_set(n.velocity)), n.velocity });
+            }
+            else if (melodic >= 0) {
+                prog.events.push_back({ sample, n.on ? ScheduledEvent::NOTE_ON : ScheduledEvent::NOTE_OFF, n.note, melodic,
+                                        midiToFreq(n.note), DRUM_PLAIN, n.on ? n.velocity : 0 });
+            }
+        }
+    }
+    // A note re-struck on the tick it ends must be released before it sounds again
+    std::stable_sort(prog.events.begin(), prog.events.end(), [](const ScheduledEvent& x, const ScheduledEvent& y) {
+        if (x.sample_index != y.sample_index) return x.sample_index < y.sample_index;
+        return (x.type == ScheduledEvent::NOTE_OFF) > (y.type == ScheduledEvent::NOTE_OFF);
+    });
+    index_held_notes(prog);
+}
+
+// A compiled program has nothing to reschedule from, so a new sample rate
+// scales its grid and events instead; positions may move by a sample.
+void retime_program(Program& prog, double sample_rate) {
+    double ratio = sample_rate / prog.sample_rate;
+    auto scale = [ratio](size_t sample) { return static_cast<size_t>(std::llround(sample * ratio)); };
+    for (size_t& sample : prog.grid.sample_at) sample = scale(sample);
+    for (ScheduledEvent& ev : prog.events) ev.sample_index = scale(ev.sample_index);
+    prog.total_samples = scale(prog.total_samples);
+    prog.sample_rate = sample_rate;
+    index_held_notes(prog);
+}
+
+void schedule_events_and_log(Program& prog, double sample_rate, ScheduleCache* cache = nullptr) {
+    if (prog.compiled) {
+        retime_program(prog, sample_rate);
+        return;
+    }
+    if (prog.smf) {
+        schedule_smf_events(prog, sample_rate);
+        return;
+    }
+    size_t n_aud = prog.audicles.size();
+    // Sections play back to back, each as long as its longest audicle
+    size_t max_steps = 0;
+    prog.plays.clear();
+    for (size_t sec : prog.form.order) {
+        const Section& section = prog.form.sections[sec];
+        size_t length = 0;
+        for (size_t a = section.first; a < section.first + section.count; ++a)
+            length = std::max(length, audicle_steps(*prog.audicles[a]));
+        prog.plays.push_back({ max_steps, section.first, section.count });
+        max_steps += length;
+    }
+    prog.sample_rate = sample_rate;
+    prog.log_rows = max_steps;
+    prog.grid = build_step_grid(prog.tempo, config.bpm, sample_rate, max_steps);
+    prog.total_samples = prog.grid.sample_at[max_steps];
+
+    decltype(ScheduleCache::audicles) scheduled;
+    if (cache) cache->reused = 0;
+    prog.schedules.assign(n_aud, nullptr);
+    for (size_t a = 0; a < n_aud; ++a) {
+        const std::shared_ptr<const Audicle>& au = prog.audicles[a];
+        if (cache) {
+            auto it = cache->audicles.find(au.get());
+            if (it != cache->audicles.end()) {
+                prog.schedules[a] = it->second.second;
+                ++cache->reused;
+            }
+        }
+        if (!prog.schedules[a])
+            prog.schedules[a] = std::make_shared<const AudicleSchedule>(schedule_audicle(*au, (int)a));
+        if (cache) scheduled[au.get()] = { au, prog.schedules[a] };
+    }
+    if (cache) cache->audicles.swap(scheduled);
+
+    // Merge every play of every audicle by (sample, event_order).
+    // A stream's events are timed in its audicle's steps from the play's first
+    // sixteenth; repetitions are expanded and placed on the grid as they come
+    // off the heap. A cached schedule may come from another position in the
+    // file, so its events are stamped with the audicle's current index.
+    struct Stream {
+        ScheduleCursor at;
+        size_t offset; // the play's first sixteenth, times den
+        size_t num, den; // sixteenths per step
+        int audicle;
+    };
+    std::vector<Stream> streams;
+    size_t total = 0;
+    for (const SectionPlay& play : prog.plays) {
+        for (size_t a = play.first; a < play.first + play.count; ++a) {
+            const Audicle& au = *prog.audicles[a];
+            streams.push_back({ { prog.schedules[a].get() }, play.start * au.step_den, au.step_num, au.step_den, (int)a });
+            total += prog.schedules[a]->event_count();
+        }
+    }
+    auto place = [&](const Stream& st) {
+        return prog.grid.sample(st.offset + st.at.step() * st.num, st.den);
+    };
+    typedef std::pair<size_t, size_t> Head; // (sample, stream)
+    auto later = [&](const Head& x, const Head& y) {
+        if (x.first != y.first) return x.first > y.first;
+        int tx = event_order(streams[x.second].at.event().type);
+        int ty = event_order(streams[y.second].at.event().type);
+        if (tx != ty) return tx > ty;
+        return x.second > y.second;
+    };
+    std::priority_queue<Head, std::vector<Head>, decltype(later)> heads(later);
+    for (size_t i = 0; i < streams.size(); ++i) {
+        streams[i].at.settle();
+        if (streams[i].at.valid()) heads.push({ place(streams[i]), i });
+    }
+    prog.events.clear();
+    prog.events.reserve(total);
+    while (!heads.empty()) {
+        Head h = heads.top();
+        heads.pop();
+        Stream& st = streams[h.second];
+        prog.events.push_back(st.at.event());
+        ScheduledEvent& ev = prog.events.back();
+        ev.audicle_idx = st.audicle;
+        ev.sample_index = h.first;
+        st.at.next();
+        if (st.at.valid()) heads.push({ place(st), h.second });
+    }
+    index_held_notes(prog);
+}
+
+// Caches a watcher keeps between reloads of the same file
+struct ProgramCache {
+    ParseCache parse;
+    ScheduleCache schedule;
+};
+
+std::unique_ptr<Program> build_program(const std::string& corpus, double sample_rate, ProgramCache* cache = nullptr) {
+    std::unique_ptr<Program> prog(new Program);
+    prog->audicles = parse_mida_file(corpus, prog->tempo, prog->form, cache ? &cache->parse : nullptr);
+    schedule_events_and_log(*prog, sample_rate, cache ? &cache->schedule : nullptr);
+    return prog;
+}
+
+// ---- Compiled programs ----
+// `compile` stores a scheduled program as a .midc file that plays with no
+// parsing or scheduling. After a fixed header come 8-byte aligned arrays of
+// fixed-width records, in native byte order. Loading checks each record in the
+// mapping and copies it into the program; events are plain structs, so that
+// allocates nothing per event. Log cells are interned into a string table. The
+// schedule is baked at the bpm it was compiled with; a different sample rate
+// rescales it.
+const uint32_t MIDC_VERSION = 7;
+const uint32_t MIDC_ENDIAN = 0x01020304; // reads as 0x04030201 on the other byte order
+
+struct MidcHeader {
+    char magic[4]; // "MIDC"
+    uint32_t endian;
+    uint32_t version;
+    uint32_t steps_per_bar;
+    uint32_t beats_per_bar;
+    uint32_t beat_type;
+    double sample_rate;
+    uint64_t audicles;
+    uint64_t runs;
+    uint64_t plays;
+    uint64_t grid; // sample_at entries
+    uint64_t events;
+    uint64_t cells;
+    uint64_t strings;
+    uint64_t string_bytes;
+    uint64_t log_rows;
+    uint64_t total_samples;
+    uint64_t checksum; // xxHash64 of everything after the header
+};
+
+struct MidcAudicle {
+    uint64_t step_num;
+    uint64_t step_den;
+    uint64_t runs;
+    int32_t drum_note;
+    uint32_t is_drum;
+};
+
+struct MidcEvent {
+    uint64_t sample_index;
+    double freq;
+    int32_t midi;
+    int32_t audicle_idx;
+    int32_t velocity;
+    uint32_t drum; // DrumKind
+    uint32_t type;
+    uint32_t unused;
+};
+
+// A run of an audicle's log cells: `cells` of them spanning `steps`, repeated
+// `repeats` times
+struct MidcRun {
+    uint64_t steps;
+    uint64_t repeats;
+    uint64_t cells;
+};
+
+struct MidcCell {
+    uint64_t steps;
+    uint32_t text; // string index
+    uint32_t unused;
+};
+
+struct MidcPlay {
+    uint64_t start;
+    uint64_t first;
+    uint64_t count;
+};
+
+static_assert(sizeof(MidcHeader) == 120 && sizeof(MidcAudicle) == 32 && sizeof(MidcRun) == 24 && sizeof(MidcCell) == 16
+    && sizeof(MidcPlay) == 24 && sizeof(MidcEvent) == 40,
+    "the .midc records are fixed-width");
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// xxHash64, reading words in native byte order
+uint64_t xxh64(const void* data, size_t len, uint64_t seed = 0) {
+    const uint64_t P1 = 11400714785074694791ULL, P2 = 14029467366897019727ULL, P3 = 1609587929392839161ULL;
+    const uint64_t P4 = 9650029242287828579ULL, P5 = 2870177450012600261ULL;
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + len;
+    auto read64 = [](const unsigned char* q) { uint64_t v; std::memcpy(&v, q, 8); return v; };
+    auto mix = [&](uint64_t acc, uint64_t v) { return rotl64(acc + v * P2, 31) * P1; };
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v[4] = { seed + P1 + P2, seed + P2, seed, seed - P1 };
+        for (; end - p >= 32; p += 32)
+            for (int i = 0; i < 4; ++i) v[i] = mix(v[i], read64(p + 8 * i));
+        h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+        for (int i = 0; i < 4; ++i) h = (h ^ mix(0, v[i])) * P1 + P4;
+    }
+    else {
+        h = seed + P5;
+    }
+    h += len;
+    for (; end - p >= 8; p += 8) h = rotl64(h ^ mix(0, read64(p)), 27) * P1 + P4;
+    if (end - p >= 4) {
+        uint32_t w;
+        std::memcpy(&w, p, 4);
+        h = rotl64(h ^ (w * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; ++p) h = rotl64(h ^ (*p * P5), 11) * P1;
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+template <typename T>
+static void append_records(std::string& out, const T* records, size_t count) {
+    out.append(reinterpret_cast<const char*>(records), count * sizeof(T));
+    out.resize((out.size() + 7) & ~size_t(7), '\0');
+}
+
+bool write_compiled_program(const Program& prog, const std::string& path) {
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<std::string> strings;
+    auto intern = [&](const std::string& s) {
+        auto it = ids.emplace(s, uint32_t(strings.size()));
+        if (it.second) strings.push_back(s);
+        return it.first->second;
+    };
+    std::vector<MidcAudicle> audicles;
+    std::vector<MidcRun> runs;
+    std::vector<MidcCell> cells;
+    for (size_t a = 0; a < prog.audicles.size(); ++a) {
+        const Audicle& au = *prog.audicles[a];
+        const std::vector<ScheduleRun>& au_runs = prog.schedules[a]->runs;
+        audicles.push_back({ au.step_num, au.step_den, au_runs.size(), au.drum_note, au.is_drum ? 1u : 0u });
+        for (const ScheduleRun& run : au_runs) {
+            runs.push_back({ run.steps, run.repeats, run.cells.size() });
+            for (size_t c = 0; c < run.cells.size(); ++c) {
+                size_t next = c + 1 < run.cells.size() ? run.cell_start[c + 1] : run.steps;
+                cells.push_back({ next - run.cell_start[c], intern(run.cells[c]), 0 });
+            }
+        }
+    }
+    std::vector<MidcEvent> events(prog.events.size());
+    for (size_t i = 0; i < events.size(); ++i) {
+        const ScheduledEvent& ev = prog.events[i];
+        events[i] = { ev.sample_index, ev.freq, ev.midi, ev.audicle_idx, ev.velocity, uint32_t(ev.drum), uint32_t(ev.type), 0 };
+    }
+    std::vector<MidcPlay> plays;
+    for (const SectionPlay& play : prog.plays) plays.push_back({ play.start, play.first, play.count });
+    std::vector<uint64_t> grid(prog.grid.sample_at.begin(), prog.grid.sample_at.end());
+    std::vector<uint64_t> offsets(1, 0);
+    std::string bytes;
+    for (const std::string& s : strings) {
+        bytes += s;
+        offsets.push_back(bytes.size());
+    }
+
+    std::string payload;
+    append_records(payload, audicles.data(), audicles.size());
+    append_records(payload, runs.data(), runs.size());
+    append_records(payload, plays.data(), plays.size());
+    append_records(payload, grid.data(), grid.size());
+    append_records(payload, events.data(), events.size());
+    append_records(payload, cells.data(), cells.size());
+    append_records(payload, offsets.data(), offsets.size());
+    append_records(payload, bytes.data(), bytes.size());
+    MidcHeader header = { { 'M', 'I', 'D', 'C' }, MIDC_ENDIAN, MIDC_VERSION, uint32_t(prog.grid.steps_per_bar),
+        uint32_t(prog.tempo.beats_per_bar), uint32_t(prog.tempo.beat_type), prog.sample_rate,
+        audicles.size(), runs.size(), plays.size(), grid.size(), events.size(), cells.size(), strings.size(), bytes.size(),
+        prog.log_rows, prog.total_samples, xxh64(payload.data(), payload.size()) };
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out.write(reinterpret_cast<const char*>(&header), sizeof header) || !out.write(payload.data(), payload.size())) {
+        std::cerr << "Could not write " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Maps a .midc file and rebuilds the program from its records, or returns null
+// after reporting why the file cannot be used
+std::unique_ptr<Program> read_compiled_program(const std::string& path) {
+    MappedFile file;
+    if (!file.open(path)) return nullptr;
+    auto fail = [&](const char* why) {
+        std::cerr << path << ": " << why << "\n";
+        return nullptr;
+    };
+    MidcHeader h;
+    if (file.size < sizeof h) return fail("not a compiled MIDA file");
+    std::memcpy(&h, file.data, sizeof h);
+    if (std::memcmp(h.magic, "MIDC", 4) != 0) return fail("not a compiled MIDA file");
+    if (h.endian != MIDC_ENDIAN) return fail("compiled on a machine of the other byte order; compile it again");
+    if (h.version != MIDC_VERSION) return fail("compiled by another version; compile it again");
+
+    // Walk the sections, checking each fits before anything is read from it
+    const unsigned char* p = file.data + sizeof h;
+    const unsigned char* end = file.data + file.size;
+    bool fits = true;
+    auto section = [&](uint64_t count, size_t width) {
+        const unsigned char* at = p;
+        size_t left = size_t(end - p);
+        if (!fits || count > left / width) {
+            fits = false;
+            return at;
+        }
+        p += std::min(left, size_t((count * width + 7) & ~uint64_t(7)));
+        return at;
+    };
+    const MidcAudicle* audicles = reinterpret_cast<const MidcAudicle*>(section(h.audicles, sizeof(MidcAudicle)));
+    const MidcRun* runs = reinterpret_cast<const MidcRun*>(section(h.runs, sizeof(MidcRun)));
+    const MidcPlay* plays = reinterpret_cast<const MidcPlay*>(section(h.plays, sizeof(MidcPlay)));
+    const uint64_t* grid = reinterpret_cast<const uint64_t*>(section(h.grid, sizeof(uint64_t)));
+    const MidcEvent* events = reinterpret_cast<const MidcEvent*>(section(h.events, sizeof(MidcEvent)));
+    const MidcCell* cells = reinterpret_cast<const MidcCell*>(section(h.cells, sizeof(MidcCell)));
+    const uint64_t* offsets = reinterpret_cast<const uint64_t*>(section(h.strings + 1, sizeof(uint64_t)));
+    const char* bytes = reinterpret_cast<const char*>(section(h.string_bytes, 1));
+    if (!fits || p != end) return fail("truncated or damaged");
+    if (xxh64(file.data + sizeof h, file.size - sizeof h) != h.checksum) return fail("checksum mismatch");
+    if (h.grid == 0 || h.log_rows >= h.grid || h.steps_per_bar == 0 || h.sample_rate <= 0) return fail("damaged header");
+
+    std::vector<std::string> strings(h.strings);
+    for (size_t s = 0; s < h.strings; ++s) {
+        if (offsets[s] > offsets[s + 1] || offsets[s + 1] > h.string_bytes) return fail("damaged string table");
+        strings[s].assign(bytes + offsets[s], bytes + offsets[s + 1]);
+    }
+    std::unique_ptr<Program> prog(new Program);
+    prog->compiled = true;
+    prog->sample_rate = h.sample_rate;
+    prog->log_rows = h.log_rows;
+    prog->total_samples = h.total_samples;
+    prog->tempo.steps_per_bar = prog->grid.steps_per_bar = h.steps_per_bar;
+    prog->tempo.beats_per_bar = h.beats_per_bar;
+    prog->tempo.beat_type = h.beat_type;
+    prog->grid.sample_at.assign(grid, grid + h.grid);
+
+    size_t run = 0, cell = 0;
+    for (size_t a = 0; a < h.audicles; ++a) {
+        const MidcAudicle& rec = audicles[a];
+        if (rec.step_num == 0 || rec.step_den == 0 || rec.runs > h.runs - run) return fail("damaged audicle table");
+        std::shared_ptr<Audicle> au = std::make_shared<Audicle>();
+        au->is_drum = rec.is_drum != 0;
+        au->name = "A" + std::to_string(a + 1);
+        au->step_num = rec.step_num;
+        au->step_den = rec.step_den;
+        au->drum_note = rec.drum_note;
+        std::shared_ptr<AudicleSchedule> sched = std::make_shared<AudicleSchedule>();
+        for (size_t end_run = run + rec.runs; run < end_run; ++run) {
+            const MidcRun& r = runs[run];
+            // Only the last run may be empty; it holds the final note-offs
+            if (r.repeats == 0 || r.cells > h.cells - cell || (r.steps == 0) != (r.cells == 0) || (r.steps == 0 && run + 1 != end_run)
+                || (r.steps && r.repeats > (SIZE_MAX - sched->steps) / r.steps))
+                return fail("damaged cell table");
+            ScheduleRun sr{ sched->steps, size_t(r.steps), size_t(r.repeats), {}, {}, {}, {} };
+            size_t at = 0;
+            for (size_t end_cell = cell + r.cells; cell < end_cell; ++cell) {
+                const MidcCell& c = cells[cell];
+                if (c.text >= h.strings || c.steps == 0 || c.steps > r.steps - at) return fail("damaged cell table");
+                sr.cells.push_back(strings[c.text]);
+                sr.cell_start.push_back(at);
+                at += c.steps;
+            }
+            if (at != r.steps) return fail("damaged cell table");
+            sched->steps += sr.steps * sr.repeats;
+            sched->runs.push_back(std::move(sr));
+        }
+        prog->audicles.push_back(au);
+        prog->schedules.push_back(sched);
+    }
+
+    for (size_t i = 0; i < h.plays; ++i) {
+        const MidcPlay& rec = plays[i];
+        if (rec.first > h.audicles || rec.count > h.audicles - rec.first || rec.start > h.log_rows
+            || (i ? rec.start < plays[i - 1].start : rec.start != 0))
+            return fail("damaged section table");
+        prog->plays.push_back({ size_t(rec.start), size_t(rec.first), size_t(rec.count) });
+    }
+
+    prog->events.reserve(h.events);
+    for (size_t i = 0; i < h.events; ++i) {
+        const MidcEvent& rec = events[i];
+        if (rec.type > ScheduledEvent::DRUM_ON || rec.drum > DRUM_GHOST || rec.audicle_idx < 0 || rec.audicle_idx >= int32_t(h.audicles)
+            || (i && rec.sample_index < events[i - 1].sample_index))
+            return fail("damaged event table");
+        prog->events.push_back({ size_t(rec.sample_index), ScheduledEvent::Type(rec.type), rec.midi, rec.audicle_idx, rec.freq,
+            DrumKind(rec.drum), rec.velocity });
+    }
+    index_held_notes(*prog);
+    return prog;
+}
+
+bool read_file(const std::string& path, std::string& out) {
+    std::ifstream infile(path, std::ios::binary);
+    if (!infile) {
+        std::cerr << "Could not open file: " << path << "\n";
+        return false;
+    }
+    out.assign((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+    return true;
+}
+
+bool is_midi_path(const std::string& path) {
+    std::string ext = std::filesystem::path(path).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+    return ext == ".mid" || ext == ".midi";
+}
+
+bool is_compiled_path(const std::string& path) {
+    return std::filesystem::path(path).extension() == ".midc";
+}
+
+bool quantize_midi = false; // --quantize: play MIDI files as their MIDA conversion
+
+// Reads and schedules a MIDA or MIDI file, or returns null after reporting why
+// not. A MIDI file plays its own ticks, velocities and tempo map, and is only
+// converted to MIDA for the log, unless --quantize plays the conversion itself.
+std::unique_ptr<Program> load_source_program(const std::string& path, double sample_rate, ProgramCache* cache) {
+    std::string corpus;
+    if (!is_midi_path(path)) {
+        if (!read_file(path, corpus)) return nullptr;
+        return build_program(corpus, sample_rate, cache);
+    }
+    std::shared_ptr<SmfSource> src = std::make_shared<SmfSource>();
+    if (!read_smf(path, src->file)) return nullptr;
+    corpus = smf_to_mida(src->file, path, &src->layout);
+    if (corpus.empty()) return nullptr;
+    if (quantize_midi) return build_program(corpus, sample_rate, cache);
+
+    std::unique_ptr<Program> prog(new Program);
+    prog->audicles = parse_mida_file(corpus, prog->tempo, prog->form, cache ? &cache->parse : nullptr);
+    const SmfFile& smf = src->file;
+    if (smf.meter_num > 0 && (smf.meter_num * 16) % smf.meter_den == 0) {
+        prog->tempo.steps_per_bar = size_t(smf.meter_num * 16 / smf.meter_den);
+        prog->tempo.beats_per_bar = size_t(smf.meter_num);
+        prog->tempo.beat_type = size_t(smf.meter_den);
+    }
+    prog->smf = src;
+    // Nothing is rescheduled from the cache; the events come from the file
+    if (cache) cache->schedule = ScheduleCache();
+    schedule_events_and_log(*prog, sample_rate);
+    return prog;
+}
+
+// ---- Compiled program cache ----
+// With cache_dir set, every file played is also compiled into that directory,
+// named by an xxHash64 of its contents and of everything the schedule depends
+// on. Playing the same file again maps the entry instead; an edited file or a
+// new bpm, rate or --quantize just misses. Hits refresh an entry's modification
+// time, and the least recently used entries go once the directory passes cache_mb.
+
+// The entry for `path` scheduled at `sample_rate`, or "" if it cannot be read
+std::string cache_entry_path(const std::string& path, double sample_rate) {
+    MappedFile file;
+    if (!file.open(path)) return "";
+    struct {
+        uint64_t contents;
+        double bpm;
+        double sample_rate;
+        uint32_t quantize;
+        uint32_t version;
+    } key = { xxh64(file.data, file.size), config.bpm, sample_rate, quantize_midi ? 1u : 0u, MIDC_VERSION };
+    char name[24];
+    std::snprintf(name, sizeof name, "%016llx.midc", (unsigned long long)xxh64(&key, sizeof key));
+    return (std::filesystem::path(config.cache_dir) / name).string();
+}
+
+// Drops the oldest entries until the directory fits in cache_mb
+void trim_cache() {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    std::vector<std::pair<fs::file_time_type, fs::path>> entries;
+    uintmax_t total = 0;
+    for (fs::directory_iterator it(config.cache_dir, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->path().extension() != ".midc") continue;
+        uintmax_t size = it->file_size(ec);
+        if (ec) continue;
+        total += size;
+        entries.push_back({ it->last_write_time(ec), it->path() });
+    }
+    const uintmax_t limit = uintmax_t(config.cache_mb * 1e6);
+    std::sort(entries.begin(), entries.end());
+    for (size_t i = 0; i < entries.size() && total > limit; ++i) {
+        uintmax_t size = fs::file_size(entries[i].second, ec);
+        if (!ec && fs::remove(entries[i].second, ec)) total -= size;
+    }
+}
+
+// Writes under a temporary name first, so concurrent runs never map half an entry
+void store_cached_program(const Program& prog, const std::string& entry) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::create_directories(config.cache_dir, ec);
+    std::string tmp = entry + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+    if (!write_compiled_program(prog, tmp)) {
+        fs::remove(tmp, ec);
+        return;
+    }
+    fs::rename(tmp, entry, ec);
+    if (ec) fs::remove(tmp, ec);
+    trim_cache();
+}
+
+// Loads any playable file: .midc directly, MIDA and MIDI through the compiled
+// program cache when there is one. A watcher's reloads bypass the cache, since
+// its own caches already make them incremental.
+std::unique_ptr<Program> load_program(const std::string& path, double sample_rate, ProgramCache* cache = nullptr) {
+    if (is_compiled_path(path)) {
+        std::unique_ptr<Program> prog = read_compiled_program(path);
+        if (prog && prog->sample_rate != sample_rate) retime_program(*prog, sample_rate);
+        return prog;
+    }
+    std::string entry;
+    if (!cache && !config.cache_dir.empty()) {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        entry = cache_entry_path(path, sample_rate);
+        if (entry.empty()) return nullptr;
+        if (fs::exists(entry, ec)) {
+            std::unique_ptr<Program> prog = read_compiled_program(entry);
+            if (prog) {
+                fs::last_write_time(entry, fs::file_time_type::clock::now(), ec);
+                return prog;
+            }
+            fs::remove(entry, ec);
+        }
+    }
+    std::unique_ptr<Program> prog = load_source_program(path, sample_rate, cache);
+    if (prog && !entry.empty()) store_cached_program(*prog, entry);
+    return prog;
+}
+
+// Index of the first event at or after `sample`
+size_t first_event_at(const Program& prog, size_t sample) {
+    return std::lower_bound(prog.events.begin(), prog.events.end(), sample,
+        [](const ScheduledEvent& ev, size_t s) { return ev.sample_index < s; }) - prog.events.begin();
+}
+
+// Index of the first log row at or after `sample`
+size_t first_row_at(const Program& prog, size_t sample) {
+    const std::vector<size_t>& at = prog.grid.sample_at;
+    return std::lower_bound(at.begin(), at.begin() + prog.log_rows, sample) - at.begin();
+}
+
+// The first bar line at or after `sample`, or the end of the program
+size_t next_bar_sample(const Program& prog, size_t sample) {
+    const std::vector<size_t>& at = prog.grid.sample_at;
+    size_t step = std::lower_bound(at.begin(), at.end(), sample) - at.begin();
+    size_t bar_step = (step + prog.grid.steps_per_bar - 1) / prog.grid.steps_per_bar * prog.grid.steps_per_bar;
+    return bar_step < at.size() ? at[bar_step] : prog.total_samples;
+}
+
+// Every note the program holds across `sample`: the checkpoint at the bar line
+// before it plus the events since, so this is O(log N) and not a replay.
+HeldNotes notes_held_at(const Program& prog, size_t sample) {
+    const std::vector<size_t>& at = prog.grid.sample_at;
+    size_t step = std::upper_bound(at.begin(), at.end(), sample) - at.begin();
+    size_t bar = step ? (step - 1) / prog.grid.steps_per_bar : 0;
+    if (bar >= prog.held_at_bar.size()) return HeldNotes();
+    HeldNotes held = prog.held_at_bar[bar];
+    for (size_t i = first_event_at(prog, at[bar * prog.grid.steps_per_bar]);
+         i < prog.events.size() && prog.events[i].sample_index < sample; ++i) {
+        const ScheduledEvent& ev = prog.events[i];
+        if (ev.type == ScheduledEvent::NOTE_ON) held[{ ev.audicle_idx, ev.midi }] = { ev.sample_index, ev.velocity };
+        else if (ev.type == ScheduledEvent::NOTE_OFF) held.erase({ ev.audicle_idx, ev.midi });
+    }
+    return held;
+}
+
+std::atomic<Program*> pending_program{ nullptr };
+std::mutex retired_mutex;
+std::vector<std::unique_ptr<Program>> retired_programs;
+std::atomic<bool> playback_done{ false };
+
+void publish_program(std::unique_ptr<Program> prog) {
+    // A program published but not yet adopted is simply superseded
+    delete pending_program.exchange(prog.release(), std::memory_order_acq_rel);
+}
+
+void retire_program(std::unique_ptr<Program> prog) {
+    std::lock_guard<std::mutex> lock(retired_mutex);
+    retired_programs.push_back(std::move(prog));
+}
+
+void reload_program(const std::string& path, ProgramCache& cache) {
+    {
+        std::lock_guard<std::mutex> lock(retired_mutex);
+        retired_programs.clear();
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    std::unique_ptr<Program> prog;
+    try {
+        prog = load_program(path, playback_sample_rate.load(), &cache);
+    }
+    catch (const std::exception& e) {
+        // A half-saved edit must not take down what is playing
+        std::cerr << "Could not reload " << path << ": " << e.what() << "; still playing the last version\n";
+        return;
+    }
+    if (!prog) return;
+    auto t1 = std::chrono::steady_clock::now();
+    size_t n_aud = prog->audicles.size();
+    const StepGrid& grid = prog->grid;
+    double bar_ms = grid.steps_per_bar < grid.sample_at.size()
+        ? (grid.sample_at[grid.steps_per_bar] - grid.sample_at[0]) * 1000.0 / prog->sample_rate : 0.0;
+    std::error_code ec;
+    uintmax_t bytes = std::filesystem::file_size(path, ec);
+    std::ostringstream msg;
+    msg << std::fixed << std::setprecision(2) << "Reloaded " << path << " (" << bytes << " bytes) in "
+        << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms";
+    // A .midc is neither parsed nor scheduled, so the caches were not used
+    if (!is_compiled_path(path)) {
+        msg << " (" << n_aud - cache.parse.reused << " of " << n_aud << " audicles reparsed, "
+            << n_aud - cache.schedule.reused << " rescheduled)";
+    }
+    msg << "; one bar is " << bar_ms << " ms\n";
+    std::cerr << msg.str();
+    publish_program(std::move(prog));
+}
+
+void watch_and_reload(const std::string& path, ProgramCache* cache) {
+    size_t slash = path.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+#ifdef __linux__
+    // Watch the directory: editors often save by renaming a new file over the old one
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        std::cerr << "Could not watch " << path << " for changes.\n";
+        if (fd >= 0) close(fd);
+        return;
+    }
+    alignas(inotify_event) char buf[4096];
+    while (!playback_done.load()) {
+        pollfd pfd{ fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 200) <= 0) continue;
+        ssize_t len = read(fd, buf, sizeof buf);
+        bool changed = false;
+        for (char* p = buf; len > 0 && p < buf + len; ) {
+            const inotify_event* ev = reinterpret_cast<const inotify_event*>(p);
+            if (ev->len && name == ev->name) changed = true;
+            p += sizeof(inotify_event) + ev->len;
+        }
+        if (changed) reload_program(path, *cache);
+    }
+    close(fd);
+#else
+    // No inotify here: poll the modification time instead
+    struct stat st;
+    time_t last = stat(path.c_str(), &st) == 0 ? st.st_mtime : 0;
+    while (!playback_done.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        if (stat(path.c_str(), &st) == 0 && st.st_mtime != last) {
+            last = st.st_mtime;
+            reload_program(path, *cache);
+        }
+    }
+#endif
+}
+
+// ---- JACK timebase master ----
+// With --timebase-master the BBT position JACK hands to other clients comes from
+// the MIDA grid itself, so bars and beats line up with the sample-exact
+// schedule and never drift. The timebase callback runs on the audio thread, so
+// it reads its own copy of the grid, swapped in under synth_mutex.
+struct Timebase {
+    StepGrid grid;
+    double beats_per_bar = 4;
+    double beat_type = 4;
+};
+
+bool timebase_master = false;
+std::unique_ptr<Timebase> timebase;
+
+void publish_timebase(const Program& prog) {
+    if (!timebase_master) return;
+    std::unique_ptr<Timebase> tb(new Timebase{ prog.grid, double(prog.tempo.beats_per_bar), double(prog.tempo.beat_type) });
+    std::lock_guard<std::mutex> lock(synth_mutex);
+    std::swap(timebase, tb);
+}
+
+void jack_timebase_callback(jack_transport_state_t, jack_nframes_t, jack_position_t* pos, int, void*) {
+    std::lock_guard<std::mutex> lock(synth_mutex);
+    if (!timebase || timebase->grid.sample_at.size() < 3) return;
+    const std::vector<size_t>& at = timebase->grid.sample_at;
+    const size_t last = at.size() - 1;
+    size_t step = std::upper_bound(at.begin(), at.end(), size_t(pos->frame)) - at.begin();
+    step = step ? step - 1 : 0;
+    // The tempo is read off a whole sixteenth pair, so swing does not wobble it
+    size_t pair = std::min(step & ~size_t(1), last - 2);
+    double sixteenth = (at[pair + 2] - at[pair]) / 2.0;
+    double frac;
+    if (step >= last) {
+        // Past the end: carry on at the final tempo
+        double extra = (pos->frame - at[last]) / sixteenth;
+        step = last + size_t(extra);
+        frac = extra - std::floor(extra);
+    }
+    else {
+        frac = double(pos->frame - at[step]) / double(at[step + 1] - at[step]);
+    }
+    const double ticks_per_beat = 1920;
+    double steps_per_beat = 16.0 / timebase->beat_type;
+    size_t spb = timebase->grid.steps_per_bar;
+    double in_beat = std::fmod((step % spb) + frac, steps_per_beat);
+    pos->valid = JackPositionBBT;
+    pos->bar = int32_t(step / spb + 1);
+    pos->beat = int32_t(((step % spb) + frac) / steps_per_beat + 1);
+    pos->tick = int32_t(in_beat / steps_per_beat * ticks_per_beat);
+    pos->beats_per_bar = float(timebase->beats_per_bar);
+    pos->beat_type = float(timebase->beat_type);
+    pos->ticks_per_beat = ticks_per_beat;
+    pos->bar_start_tick = (pos->bar - 1) * timebase->beats_per_bar * ticks_per_beat;
+    pos->beats_per_minute = 60.0 * pos->frame_rate / (sixteenth * steps_per_beat);
+}
+
+// ---- Transport: seek and loop ----
+// Positions are 1-based "bar" or "bar.step" (step in sixteenths) and are kept
+// symbolic, so they follow the playing program's meter across reloads.
+struct Position {
+    size_t bar = 1;
+    size_t step = 1;
+};
+
+struct TransportCommand {
+    enum Type { SEEK, LOOP, LOOP_OFF } type;
+    Position a; // seek target, or loop start
+    Position b; // loop end (exclusive)
+};
+
+bool parse_position(const std::string& s, Position& pos) {
+    size_t dot = s.find('.');
+    try {
+        size_t used = 0;
+        std::string bar = s.substr(0, dot);
+        pos.bar = std::stoul(bar, &used);
+        if (used != bar.size() || bar[0] == '-') return false;
+        pos.step = 1;
+        if (dot != std::string::npos) {
+            std::string step = s.substr(dot + 1);
+            pos.step = std::stoul(step, &used);
+            if (used != step.size() || step[0] == '-') return false;
+        }
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+    return pos.bar > 0 && pos.step > 0;
+}
+
+// "seek <pos>", "loop <pos>-<pos>" or "loop off"
+bool parse_transport_command(const std::string& line, TransportCommand& cmd) {
+    std::istringstream in(line);
+    std::string verb, arg, extra;
+    if (!(in >> verb >> arg) || (in >> extra)) return false;
+    if (verb == "seek") {
+        cmd.type = TransportCommand::SEEK;
+        return parse_position(arg, cmd.a);
+    }
+    if (verb == "loop" && arg == "off") {
+        cmd.type = TransportCommand::LOOP_OFF;
+        return true;
+    }
+    size_t dash = arg.find('-');
+    cmd.type = TransportCommand::LOOP;
+    return verb == "loop" && dash != std::string::npos
+        && parse_position(arg.substr(0, dash), cmd.a) && parse_position(arg.substr(dash + 1), cmd.b);
+}
+
+// The sixteenth a position falls on, clamped to the end of the program
+size_t position_step(const Program& prog, const Position& pos) {
+    size_t step = (pos.bar - 1) * prog.grid.steps_per_bar + (pos.step - 1);
+    return std::min(step, prog.log_rows);
+}
+
+// Commands from --start/--loop and stdin, drained by the playback thread
+std::mutex transport_mutex;
+std::vector<TransportCommand> transport_commands;
+
+void queue_transport_command(const TransportCommand& cmd) {
+    std::lock_guard<std::mutex> lock(transport_mutex);
+    transport_commands.push_back(cmd);
+}
+
+// Reads transport commands, one per line, until playback ends or stdin closes
+void read_transport_commands() {
+#ifndef _WIN32
+    std::string pending;
+    char buf[256];
+    while (!playback_done.load()) {
+        pollfd pfd{ STDIN_FILENO, POLLIN, 0 };
+        if (poll(&pfd, 1, 200) <= 0) continue;
+        ssize_t len = read(STDIN_FILENO, buf, sizeof buf);
+        if (len <= 0) return;
+        pending.append(buf, len);
+        for (size_t nl; (nl = pending.find('\n')) != std::string::npos; pending.erase(0, nl + 1)) {
+            std::string line = trim(pending.substr(0, nl));
+            TransportCommand cmd;
+            if (line.empty()) continue;
+            if (parse_transport_command(line, cmd)) queue_transport_command(cmd);
+            else std::cerr << "Unknown command: " << line << " (seek <bar[.step]>, loop <from>-<to>, loop off)\n";
+        }
+    }
+#endif
+}
+
+// Moves playback to `sample`: the engine jumps there with the notes held across
+// it, and the index of the first event still to dispatch is returned.
+size_t seek_to(const Program& prog, size_t sample, bool move_playhead = true) {
+    seek_engine(sample, notes_held_at(prog, sample), move_playhead);
+    return first_event_at(prog, sample);
+}
+
+// ---- Unified playback and log scheduler ----
+// Hands one event to the synth
+void dispatch_event(const ScheduledEvent& ev) {
+    if (ev.type == ScheduledEvent::NOTE_ON) {
+        trigger_note(ev.audicle_idx, ev.midi, ev.freq, ev.sample_index, ev.velocity);
+    }
+    else if (ev.type == ScheduledEvent::NOTE_OFF) {
+        release_note(ev.audicle_idx, ev.midi, ev.sample_index);
+    }
+    else if (ev.type == ScheduledEvent::DRUM_ON) {
+        trigger_drum(ev.audicle_idx, ev.drum, ev.sample_index);
+    }
+}
+
+// Queues one event's MIDI; a drum hit is let go once the internal drum
+// envelope would have died away.
+void queue_midi_event(const ScheduledEvent& ev) {
+    std::lock_guard<std::mutex> lock(synth_mutex);
+    if (ev.type == ScheduledEvent::NOTE_ON || ev.type == ScheduledEvent::NOTE_OFF) {
+        queue_midi_note(ev.audicle_idx, ev.midi, ev.type == ScheduledEvent::NOTE_ON, ev.sample_index, ev.velocity);
+    }
+    else if (ev.type == ScheduledEvent::DRUM_ON) {
+        int note = ev.midi >= 0 ? ev.midi : int(config.drum_note);
+        double velocity = ev.velocity ? ev.velocity : ev.drum == DRUM_ACCENT ? config.drum_accent_velocity
+            : ev.drum == DRUM_GHOST ? config.drum_ghost_velocity : config.drum_velocity;
+        size_t length = static_cast<size_t>((config.drum_attack + config.drum_decay) * synth_tables->sample_rate);
+        queue_midi(ev.sample_index, 0x90 | MIDI_DRUM_CHANNEL, note, int(velocity));
+        queue_midi(ev.sample_index + length, 0x80 | MIDI_DRUM_CHANNEL, note, 0);
+    }
+}
+
+bool quiet = false; // --quiet: no log grid on stdout
+
+void print_header(const Program& prog) {
+    for (size_t a = 0; a < prog.audicles.size(); ++a) std::cout << "A" << (a + 1) << " ";
+    std::cout << std::endl;
+}
+
+// One log row per sixteenth shows each audicle's step sounding at its start,
+// so drum cells are visually upsampled to two rows. Audicles of sections other
+// than the one playing are left blank. Rows are rendered from the schedules'
+// cells as the playhead reaches them; nothing is kept per row.
+
+// The section play a log row falls in, or null before the first
+const SectionPlay* play_at_row(const Program& prog, size_t row) {
+    auto play = std::upper_bound(prog.plays.begin(), prog.plays.end(), row,
+        [](size_t r, const SectionPlay& p) { return r < p.start; });
+    return play == prog.plays.begin() ? nullptr : &*(play - 1);
+}
+
+const std::string& log_cell(const Program& prog, const SectionPlay& play, size_t row, size_t a) {
+    static const std::string drum_rest = "_", rest = ".", blank = "";
+    if (a < play.first || a >= play.first + play.count) return blank;
+    const Audicle& au = *prog.audicles[a];
+    const std::string* cell = prog.schedules[a]->cell((row - play.start) * au.step_den / au.step_num);
+    return cell ? *cell : au.is_drum ? drum_rest : rest;
+}
+
+void print_log_row(const Program& prog, size_t row) {
+    const SectionPlay* play = play_at_row(prog, row);
+    if (!play) return;
+    for (size_t a = 0; a < prog.audicles.size(); ++a)
+        std::cout << std::setw(3) << log_cell(prog, *play, row, a);
+    std::cout << " <" << std::endl;
+}
+
+// ---- Tracker view ----
+// --tracker shows the log grid full screen instead: a page of rows as tall as
+// the terminal with the playing row marked, turning to the next page when the
+// playhead runs off the bottom. Frames are drawn at most tracker_fps times a
+// second whatever the step rate, and only cells that differ from the screen
+// are rewritten, so most frames just move the marker.
+bool tracker = false;
+
+const char TRACKER_RESTORE[] = "\x1b[?25h\x1b[?1049l";
+
+// Gives the terminal back if playback is interrupted
+extern "C" void restore_terminal_and_raise(int sig) {
+#ifndef _WIN32
+    ssize_t n = write(STDOUT_FILENO, TRACKER_RESTORE, sizeof TRACKER_RESTORE - 1);
+    (void)n;
+#endif
+    std::signal(sig, SIG_DFL);
+    std::raise(sig);
+}
+
+class TrackerView {
+public:
+    static const size_t LABEL_WIDTH = 10; // ">1234.16  "
+    static const size_t CELL_WIDTH = 4;
+
+    // Switches to the alternate screen; false when stdout is not a terminal
+    bool open() {
+#ifndef _WIN32
+        if (!isatty(STDOUT_FILENO)) return false;
+        std::signal(SIGINT, restore_terminal_and_raise);
+        std::signal(SIGTERM, restore_terminal_and_raise);
+        std::cout << "\x1b[?1049h\x1b[?25l" << std::flush;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void close() {
+        std::cout << TRACKER_RESTORE << std::flush;
+        std::signal(SIGINT, SIG_DFL);
+        std::signal(SIGTERM, SIG_DFL);
+    }
+
+    // Forgets what is on screen, e.g. after a message was printed over it
+    void invalidate() { lines.clear(); }
+
+    void draw(const Program& prog, size_t row) {
+        size_t width = 80, height = 24;
+#ifndef _WIN32
+        winsize ws;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row && ws.ws_col) {
+            width = ws.ws_col;
+            height = ws.ws_row;
+        }
+#endif
+        size_t rows = height > 2 ? height - 2 : 1;
+        size_t cols = std::min(prog.audicles.size(), width > LABEL_WIDTH ? (width - LABEL_WIDTH) / CELL_WIDTH : 0);
+        size_t first = row / rows * rows;
+        out.clear();
+        if (lines.empty() || width != shown_width || height != shown_height || cols != shown_cols || first != shown_first) {
+            // Resized or a new page: start from a cleared screen
+            out += "\x1b[2J";
+            lines.assign(height, {});
+            shown_width = width;
+            shown_height = height;
+            shown_cols = cols;
+            shown_first = first;
+        }
+
+        put(0, 0, 0, fit("  bar.st", LABEL_WIDTH));
+        for (size_t a = 0; a < cols; ++a) put(0, a + 1, LABEL_WIDTH + a * CELL_WIDTH, cell_text("A" + std::to_string(a + 1)));
+        for (size_t y = 1; y <= rows && y < height; ++y) {
+            size_t r = first + y - 1;
+            const SectionPlay* play = r < prog.log_rows ? play_at_row(prog, r) : nullptr;
+            put(y, 0, 0, fit(play ? (r == row ? ">" : " ") + step_label(prog, r) : "", LABEL_WIDTH));
+            for (size_t a = 0; a < cols; ++a)
+                put(y, a + 1, LABEL_WIDTH + a * CELL_WIDTH, cell_text(play ? log_cell(prog, *play, r, a) : ""));
+        }
+        std::string status = " " + step_label(prog, std::min(row, prog.log_rows ? prog.log_rows - 1 : 0))
+            + " of " + std::to_string((prog.log_rows + prog.grid.steps_per_bar - 1) / prog.grid.steps_per_bar) + " bars";
+        if (cols < prog.audicles.size()) status += ", " + std::to_string(prog.audicles.size() - cols) + " audicles off screen";
+        if (height > 1) put(height - 1, 0, 0, fit(status, width));
+
+        if (!out.empty()) std::cout << out << std::flush;
+    }
+
+private:
+    std::vector<std::vector<std::string>> lines; // text of each cell on screen, by line
+    size_t shown_width = 0, shown_height = 0, shown_cols = 0, shown_first = 0;
+    std::string out;
+
+    // Queues `text` at line y, column x unless the cell already shows it
+    void put(size_t y, size_t cell, size_t x, const std::string& text) {
+        std::vector<std::string>& line = lines[y];
+        if (line.size() <= cell) line.resize(cell + 1);
+        if (line[cell] == text) return;
+        line[cell] = text;
+        out += "\x1b[" + std::to_string(y + 1) + ";" + std::to_string(x + 1) + "H" + text;
+    }
+
+    static std::string step_label(const Program& prog, size_t row) {
+        char buf[48];
+        std::snprintf(buf, sizeof buf, "%4zu.%02zu", row / prog.grid.steps_per_bar + 1, row % prog.grid.steps_per_bar + 1);
+        return buf;
+    }
+
+    static std::string fit(const std::string& text, size_t width) {
+        return text.size() >= width ? text.substr(0, width) : text + std::string(width - text.size(), ' ');
+    }
+
+    // Right-aligned like the log; chords too wide for the column end in '+'
+    static std::string cell_text(const std::string& text) {
+        const size_t w = CELL_WIDTH - 1;
+        if (text.size() > w) return " " + text.substr(0, w - 1) + "+";
+        return std::string(CELL_WIDTH - text.size(), ' ') + text;
+    }
+};
+
+// Swaps in the pending reload, rescheduled to `sample_rate` if need be; the
+// old program goes to the watcher to free.
+std::unique_ptr<Program> adopt_pending_program(std::unique_ptr<Program> prog, double sample_rate) {
+    std::unique_ptr<Program> next(pending_program.exchange(nullptr, std::memory_order_acq_rel));
+    if (next->sample_rate != sample_rate) {
+        TRACE(TRACE_SCHEDULE_BEGIN, 0, 0, 0);
+        schedule_events_and_log(*next, sample_rate);
+        TRACE(TRACE_SCHEDULE_END, 0, 0, 0);
+    }
+    if (!quiet && !tracker && next->audicles.size() != prog->audicles.size()) print_header(*next);
+    publish_timebase(*next);
+    reserve_synth(0, next->audicles.size());
+    retire_program(std::move(prog));
+    return next;
+}
+
+// Seeks to a sixteenth. Under JACK transport this asks the server to relocate
+// instead, and the jump is picked up like any other transport locate.
+size_t seek_to_step(const Program& prog, size_t step, size_t event_idx) {
+    size_t sample = prog.grid.sample_at[step];
+    if (!transport_client) return seek_to(prog, sample);
+    jack_transport_locate(transport_client, jack_nframes_t(sample));
+    return event_idx;
+}
+
+// How long the playback thread waits for a period before looking at commands anyway
+const std::chrono::milliseconds PERIOD_TIMEOUT(100);
+
+void playback_and_log(std::unique_ptr<Program> prog, double sample_rate) {
+    size_t event_idx = 0;
+    size_t swap_at = SIZE_MAX; // bar line where a pending reload is adopted
+    bool looping = false;
+    bool was_rolling = true;
+    Position loop_from, loop_to;
+    size_t midi_idx = 0; // next event to queue as MIDI, running ahead of event_idx
+    size_t midi_seen = midi_resets;
+    size_t next_row = 0; // next log row to print; reset wherever event_idx jumps
+    // A queued loop wrap not yet applied; event_idx is then past it, on the clock after it
+    bool wrap_queued = false;
+    size_t wrap_from = 0, wrap_to = 0, wraps_seen = 0;
+    TRACE_THREAD("playback");
+    TrackerView view;
+    bool tracking = tracker && view.open();
+    if (tracker && !tracking) std::cerr << "stdout is not a terminal, printing the log instead of --tracker\n";
+    auto frame_time = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1 / config.tracker_fps));
+    auto next_frame = std::chrono::steady_clock::now();
+    playback_sample_rate.store(sample_rate);
+    publish_timebase(*prog);
+    reserve_synth(0, prog->audicles.size());
+    if (!quiet && !tracking) print_header(*prog);
+
+    while (event_idx < prog->events.size() || (!quiet && next_row < prog->log_rows) || looping) {
+        jack_nframes_t new_rate = pending_sample_rate.exchange(0);
+        if (new_rate && new_rate != sample_rate) {
+            // Reschedule and rebuild the tables here, off the audio thread
+            TRACE(TRACE_SCHEDULE_BEGIN, 0, 0, 0);
+            schedule_events_and_log(*prog, new_rate);
+            TRACE(TRACE_SCHEDULE_END, 0, 0, 0);
+            publish_timebase(*prog);
+            std::unique_ptr<SynthTables> tables = build_synth_tables(config, new_rate);
+            size_t playhead = change_sample_rate(tables);
+            sample_rate = new_rate;
+            playback_sample_rate.store(sample_rate);
+            // The queue was dropped, and nothing at or after the playhead has been rendered
+            event_idx = first_event_at(*prog, playhead);
+            next_row = first_row_at(*prog, playhead + 1);
+            swap_at = SIZE_MAX;
+            wrap_queued = false;
+            HeldNotes held = notes_held_at(*prog, playhead);
+            reserve_synth(held.size(), 0);
+            {
+                std::lock_guard<std::mutex> lock(synth_mutex);
+                reset_midi(held, playhead);
+            }
+            std::cerr << "Sample rate changed to " << new_rate << " Hz\n";
+            view.invalidate();
+        }
+        std::vector<TransportCommand> commands;
+        {
+            std::lock_guard<std::mutex> lock(transport_mutex);
+            commands.swap(transport_commands);
+        }
+        for (const TransportCommand& cmd : commands) {
+            if (cmd.type == TransportCommand::SEEK) {
+                size_t step = position_step(*prog, cmd.a);
+                event_idx = seek_to_step(*prog, step, event_idx);
+                if (!transport_client) next_row = step;
+                swap_at = SIZE_MAX;
+                wrap_queued = false;
+                std::cerr << "Seek to " << cmd.a.bar << "." << cmd.a.step << "\n";
+            }
+            else if (cmd.type == TransportCommand::LOOP) {
+                looping = true;
+                loop_from = cmd.a;
+                loop_to = cmd.b;
+                std::cerr << "Loop " << loop_from.bar << "." << loop_from.step << "-" << loop_to.bar << "." << loop_to.step << "\n";
+            }
+            else {
+                looping = false;
+            }
+            view.invalidate();
+        }
+        // Loop ends are resolved every pass, as a reload may change the meter
+        if (looping && position_step(*prog, loop_from) >= position_step(*prog, loop_to)) {
+            std::cerr << "Empty loop region, loop off\n";
+            looping = false;
+            view.invalidate();
+        }
+        size_t loop_end = looping ? prog->grid.sample_at[position_step(*prog, loop_to)] : SIZE_MAX;
+        // The flag goes first: a relocation after it is seen on the next pass,
+        // and one before it is already in the playhead and generation read after
+        bool rolling = transport_rolling.load();
+        bool located = transport_located.exchange(false);
+        uint32_t generation = locate_generation.load(std::memory_order_acquire);
+        size_t playhead = global_playhead_samples.load(std::memory_order_acquire);
+        if (transport_client) {
+            // Follow JACK transport: hold on stop, seek on start and on relocation
+            if (!rolling) {
+                if (was_rolling) seek_engine(playhead, HeldNotes(), false);
+                was_rolling = false;
+                period_wakeup.wait(PERIOD_TIMEOUT);
+                continue;
+            }
+            if (located || !was_rolling) {
+                event_idx = seek_to(*prog, playhead, false);
+                next_row = first_row_at(*prog, playhead);
+                swap_at = SIZE_MAX;
+                was_rolling = true;
+                continue;
+            }
+        }
+        if (wrap_queued) {
+            // The callback moves the playhead and counts the wrap under the lock
+            std::lock_guard<std::mutex> lock(synth_mutex);
+            playhead = global_playhead_samples.load(std::memory_order_relaxed);
+            if (loop_wraps != wraps_seen) {
+                next_row = first_row_at(*prog, wrap_to);
+                wrap_queued = false;
+            }
+        }
+        // Events and MIDI already queued must not cross the bar line a reload is adopted at
+        size_t midi_lookahead = midi_port ? static_cast<size_t>(config.midi_lookahead * sample_rate) : 0;
+        size_t audio_lookahead = static_cast<size_t>(config.lookahead_periods * period_frames.load(std::memory_order_relaxed));
+        if (swap_at == SIZE_MAX && !wrap_queued && pending_program.load(std::memory_order_acquire)) {
+            swap_at = next_bar_sample(*prog, playhead + std::max(midi_lookahead, audio_lookahead) + 1);
+        }
+        if (midi_seen != midi_resets) {
+            // A seek restarted MIDI at event_idx
+            midi_seen = midi_resets;
+            midi_idx = event_idx;
+        }
+        const std::vector<ScheduledEvent>& events = prog->events;
+        size_t stop_at = std::min(swap_at, loop_end);
+        // Past a queued wrap the horizons carry on from the loop start
+        size_t horizon = playhead + audio_lookahead;
+        size_t midi_horizon = playhead + midi_lookahead;
+        if (wrap_queued) {
+            horizon = wrap_to + (std::max(horizon, wrap_from) - wrap_from);
+            midi_horizon = wrap_to + (std::max(midi_horizon, wrap_from) - wrap_from);
+        }
+        size_t queued_from = event_idx;
+        size_t queue_to = event_idx;
+        while (queue_to < events.size() && events[queue_to].sample_index <= horizon && events[queue_to].sample_index < stop_at)
+            ++queue_to;
+        if (queue_to > event_idx) {
+            reserve_synth(queue_to - event_idx, 0);
+            std::lock_guard<std::mutex> lock(synth_mutex);
+            for (; event_idx < queue_to; ++event_idx) {
+                const ScheduledEvent& ev = events[event_idx];
+                TRACE(TRACE_DISPATCH, ev.type << 8 | (ev.midi & 0xff), ev.audicle_idx,
+                    int64_t(horizon) - int64_t(audio_lookahead) - int64_t(ev.sample_index));
+                queue_audio_event({ ev.sample_index, QueuedEvent::Type(ev.type), ev.audicle_idx, ev.midi, ev.velocity, ev.freq, ev.drum },
+                    generation);
+            }
+        }
+        metrics.events_queued.fetch_add(event_idx - queued_from, std::memory_order_relaxed);
+        metrics.events_pending.store(events.size() - event_idx, std::memory_order_relaxed);
+        if (!quiet) {
+            const std::vector<size_t>& row_at = prog->grid.sample_at;
+            size_t rows_to = wrap_queued ? wrap_from : stop_at;
+            for (; next_row < prog->log_rows && row_at[next_row] <= playhead && row_at[next_row] < rows_to; ++next_row)
+                if (!tracking) print_log_row(*prog, next_row);
+        }
+        if (tracking && std::chrono::steady_clock::now() >= next_frame) {
+            view.draw(*prog, next_row ? next_row - 1 : 0);
+            next_frame = std::chrono::steady_clock::now() + frame_time;
+        }
+        if (midi_port) {
+            size_t midi_to = midi_idx;
+            while (midi_to < events.size() && events[midi_to].sample_index <= midi_horizon && events[midi_to].sample_index < stop_at)
+                ++midi_to;
+            if (midi_to > midi_idx) reserve_synth(midi_to - midi_idx, 0);
+            for (; midi_idx < midi_to; ++midi_idx)
+                queue_midi_event(events[midi_idx]);
+        }
+        if (swap_at < loop_end && !wrap_queued && swap_at <= std::max(horizon, midi_horizon)
+            && (event_idx == events.size() || events[event_idx].sample_index >= swap_at)
+            && (!midi_port || midi_idx == events.size() || events[midi_idx].sample_index >= swap_at)) {
+            // Live swap: everything before the bar line is queued, so adopt the
+            // reload now and queue its notes from the bar line on, as for a wrap.
+            // The clock runs straight through, so the note changes at swap_at
+            // are all the callback needs to see of it.
+            if (!quiet) {
+                const std::vector<size_t>& row_at = prog->grid.sample_at;
+                for (; next_row < prog->log_rows && row_at[next_row] < swap_at; ++next_row)
+                    if (!tracking) print_log_row(*prog, next_row);
+            }
+            HeldNotes was_held = notes_held_at(*prog, swap_at);
+            prog = adopt_pending_program(std::move(prog), sample_rate);
+            HeldNotes held = notes_held_at(*prog, swap_at);
+            // midi_held only changes on this thread, so its size can be read unlocked
+            reserve_synth(std::max(was_held.size(), midi_held.size()) + held.size(), 0);
+            std::lock_guard<std::mutex> lock(synth_mutex);
+            for (const auto& note : was_held) {
+                if (held.count(note.first)) continue;
+                queue_audio_event({ swap_at, QueuedEvent::NOTE_OFF, note.first.first, note.first.second, 0, 0.0, DRUM_PLAIN }, generation);
+            }
+            for (const auto& note : held) {
+                if (was_held.count(note.first)) continue;
+                QueuedEvent on{ swap_at, QueuedEvent::NOTE_ON, note.first.first, note.first.second, note.second.velocity,
+                    midiToFreq(note.first.second), DRUM_PLAIN };
+                on.sounded = swap_at - note.second.since;
+                queue_audio_event(std::move(on), generation);
+            }
+            std::set<std::pair<int, int>> midi_on = midi_held;
+            for (const auto& note : midi_on)
+                if (!held.count(note)) queue_midi_note(note.first, note.second, false, swap_at);
+            for (const auto& note : held)
+                if (!midi_on.count(note.first)) queue_midi_note(note.first.first, note.first.second, true, swap_at, note.second.velocity);
+            event_idx = midi_idx = first_event_at(*prog, swap_at);
+            next_row = first_row_at(*prog, swap_at);
+            swap_at = SIZE_MAX;
+            continue;
+        }
+        if (looping && !transport_client && !wrap_queued && playhead < loop_end && loop_end <= playhead + audio_lookahead
+            && swap_at >= loop_end && (event_idx == events.size() || events[event_idx].sample_index >= loop_end)) {
+            // Everything before loop_end is queued: queue the wrap, then the
+            // notes held into the loop start, and go on queueing from there
+            if (midi_port) {
+                size_t midi_to = midi_idx;
+                while (midi_to < events.size() && events[midi_to].sample_index < loop_end) ++midi_to;
+                if (midi_to > midi_idx) reserve_synth(midi_to - midi_idx, 0);
+                for (; midi_idx < midi_to; ++midi_idx)
+                    queue_midi_event(events[midi_idx]);
+            }
+            if (pending_program.load(std::memory_order_acquire)) {
+                // A reload waiting on a bar line the loop never reaches is taken
+                // here, after the rest of the old program's log
+                if (!quiet) {
+                    const std::vector<size_t>& row_at = prog->grid.sample_at;
+                    for (; next_row < prog->log_rows && row_at[next_row] < loop_end; ++next_row)
+                        if (!tracking) print_log_row(*prog, next_row);
+                }
+                prog = adopt_pending_program(std::move(prog), sample_rate);
+                next_row = first_row_at(*prog, loop_end);
+            }
+            wrap_from = loop_end;
+            wrap_to = prog->grid.sample_at[position_step(*prog, loop_from)];
+            HeldNotes held = notes_held_at(*prog, wrap_to);
+            reserve_synth(held.size() + 1, 0);
+            std::lock_guard<std::mutex> lock(synth_mutex);
+            wrap_midi(held, wrap_from, wrap_to);
+            QueuedEvent wrap{ wrap_from, QueuedEvent::LOOP_WRAP, -1, -1, 0, 0.0, DRUM_PLAIN };
+            wrap.wrap_to = wrap_to;
+            queue_audio_event(std::move(wrap), generation);
+            for (const auto& note : held) {
+                QueuedEvent on{ wrap_to, QueuedEvent::NOTE_ON, note.first.first, note.first.second, note.second.velocity,
+                    midiToFreq(note.first.second), DRUM_PLAIN };
+                on.sounded = wrap_to - note.second.since;
+                queue_audio_event(std::move(on), generation);
+            }
+            event_idx = midi_idx = first_event_at(*prog, wrap_to);
+            wraps_seen = loop_wraps;
+            wrap_queued = true;
+            swap_at = SIZE_MAX;
+            continue;
+        }
+        if (!wrap_queued && playhead >= loop_end) {
+            // Wrap here where none was queued: the loop was set behind the
+            // playhead, or JACK transport is relocated rather than wrapped
+            if (pending_program.load(std::memory_order_acquire))
+                prog = adopt_pending_program(std::move(prog), sample_rate);
+            size_t step = position_step(*prog, loop_from);
+            event_idx = seek_to_step(*prog, step, event_idx);
+            if (!transport_client) next_row = step;
+            swap_at = SIZE_MAX;
+            if (transport_client) period_wakeup.wait(PERIOD_TIMEOUT);
+            continue;
+        }
+        TRACE(TRACE_WAIT_BEGIN, 0, 0, 0);
+        period_wakeup.wait(PERIOD_TIMEOUT);
+        TRACE(TRACE_WAIT_END, 0, 0, 0);
+    }
+    // Wait for tail of audio to finish (a stopped transport never gets there)
+    while (global_playhead_samples.load(std::memory_order_acquire) < prog->total_samples + static_cast<size_t>(config.release * sample_rate)
+        && (!transport_client || transport_rolling.load())) {
+        period_wakeup.wait(PERIOD_TIMEOUT);
+    }
+    if (tracking) {
+        view.draw(*prog, next_row ? next_row - 1 : 0);
+        view.close();
+    }
+    std::cerr << "Events applied late: " << metrics.events_late.load() << " of " << metrics.events_queued.load() << "\n";
+    playback_done.store(true);
+}
+
+// ---- Metrics endpoint ----
+// With metrics_port set, a thread answers every HTTP request on that port of
+// 127.0.0.1 with the counters in Prometheus text format, whatever the path.
+std::string format_metrics(jack_client_t* client) {
+    std::ostringstream out;
+    out << std::setprecision(15); // counters stay exact
+    auto metric = [&out](const char* name, const char* type, const char* help, double value) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n" << name << " " << value << "\n";
+    };
+    uint64_t ns = metrics.callback_ns.load(std::memory_order_relaxed);
+    metric("mida_voices", "gauge", "Pitched voices sounding.", double(metrics.voices.load(std::memory_order_relaxed)));
+    metric("mida_drum_voices", "gauge", "Drum voices sounding.", double(metrics.drum_voices.load(std::memory_order_relaxed)));
+    metric("mida_callbacks_total", "counter", "Process callbacks run.", double(metrics.callbacks.load(std::memory_order_relaxed)));
+    metric("mida_callback_seconds_total", "counter", "Time spent in the process callback.", ns * 1e-9);
+    metric("mida_frames_total", "counter", "Frames rendered by the process callback.", double(metrics.frames.load(std::memory_order_relaxed)));
+    metric("mida_callback_load_peak", "gauge", "Worst callback time over its period since the last scrape.",
+        metrics.callback_load_peak.exchange(0, std::memory_order_relaxed));
+    metric("mida_jack_cpu_load", "gauge", "JACK server DSP load, percent.", client ? jack_cpu_load(client) : 0);
+    metric("mida_xruns_total", "counter", "JACK xruns.", double(metrics.xruns.load(std::memory_order_relaxed)));
+    metric("mida_events_pending", "gauge", "Scheduled events not yet queued for the process callback.",
+        double(metrics.events_pending.load(std::memory_order_relaxed)));
+    metric("mida_events_queued_total", "counter", "Scheduled events queued for the process callback.",
+        double(metrics.events_queued.load(std::memory_order_relaxed)));
+    metric("mida_events_late_total", "counter", "Events applied after their sample had been rendered.",
+        double(metrics.events_late.load(std::memory_order_relaxed)));
+    metric("mida_midi_queued", "gauge", "MIDI messages queued for the process callback.", double(metrics.midi_queued.load(std::memory_order_relaxed)));
+    return out.str();
+}
+
+// Serves until playback ends
+void serve_metrics(jack_client_t* client, int port) {
+#ifndef _WIN32
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(uint16_t(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) != 0
+        || bind(fd, (sockaddr*)&addr, sizeof addr) != 0 || listen(fd, 8) != 0) {
+        std::cerr << "Could not serve metrics on port " << port << ": " << std::strerror(errno) << "\n";
+        if (fd >= 0) close(fd);
+        return;
+    }
+    while (!playback_done.load()) {
+        pollfd pfd{ fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 200) <= 0) continue;
+        int conn = accept(fd, nullptr, nullptr);
+        if (conn < 0) continue;
+        // The request is read only so the client sees a clean close
+        char buf[1024];
+        pollfd cfd{ conn, POLLIN, 0 };
+        if (poll(&cfd, 1, 100) > 0) {
+            ssize_t n = recv(conn, buf, sizeof buf, 0);
+            (void)n;
+        }
+        std::string body = format_metrics(client);
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+            + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        for (size_t sent = 0; sent < response.size();) {
+            ssize_t n = send(conn, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += size_t(n);
+        }
+        close(conn);
+    }
+    close(fd);
+#endif
+}
+
+// ---- Offline render benchmark ----
+// Renders the whole schedule without JACK, dispatching events at block
+// boundaries the way playback_and_log does, and times only render_block.
+int run_bench(const Program& prog, double sample_rate, jack_nframes_t block) {
+    TRACE_THREAD("process"); // renders in place of the audio callback
+    const std::vector<ScheduledEvent>& events = prog.events;
+    std::vector<float> out(block);
+    size_t end = prog.total_samples + static_cast<size_t>(config.release * sample_rate);
+    size_t event_idx = 0;
+    size_t peak_voices = 0;
+    double voice_samples = 0.0;
+    double render_ns = 0.0;
+    global_playhead_samples.store(0);
+    while (global_playhead_samples.load() < end) {
+        size_t playhead = global_playhead_samples.load();
+        while (event_idx < events.size() && events[event_idx].sample_index <= playhead) {
+            dispatch_event(events[event_idx]);
+            ++event_idx;
+        }
+        size_t sounding = drum_voices.size() + std::count_if(voices.begin(), voices.end(), [](const Voice& v) { return v.active; });
+        peak_voices = std::max(peak_voices, sounding);
+        voice_samples += double(sounding) * block;
+        auto t0 = std::chrono::steady_clock::now();
+        render_block(out.data(), block);
+        auto t1 = std::chrono::steady_clock::now();
+        render_ns += std::chrono::duration<double, std::nano>(t1 - t0).count();
+    }
+    size_t rendered = global_playhead_samples.load();
+    std::cout << "rendered " << rendered << " samples (" << rendered / sample_rate << " s) in blocks of " << block << "\n"
+        << "peak voices " << peak_voices << "\n"
+        << std::fixed << std::setprecision(2)
+        << "render " << render_ns / 1e6 << " ms, " << render_ns / rendered << " ns/sample, "
+        << render_ns / std::max(voice_samples, 1.0) << " ns/voice-sample, "
+        << (rendered / sample_rate) / (render_ns / 1e9) << "x realtime\n";
+    return 0;
+}
+
+// ---- Scheduler benchmark ----
+// `bench-schedule [bars]` parses and schedules a generated chord-heavy song:
+// eight melodic audicles of three to six note chords that move a voice or two
+// on most sixteenths, so little repeats and nearly every step changes notes.
+// Parsing and scheduling are timed separately, best of five.
+std::string chord_bench_corpus(size_t bars) {
+    uint32_t seed = 1;
+    auto rnd = [&](uint32_t n) {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) % n;
+    };
+    std::string corpus = "`~#\n\xe2\x80\x98\n";
+    for (int a = 0; a < 8; ++a) {
+        int low = 36 + 6 * a;
+        std::vector<int> chord;
+        for (int k = 0; k < 4; ++k) chord.push_back(low + int(rnd(24)));
+        std::string line = "*";
+        for (size_t step = 0; step < bars * 16; ++step) {
+            if (step) line += ' ';
+            if (rnd(4) == 0) {
+                line += "-";
+                continue;
+            }
+            for (uint32_t moves = 1 + rnd(2); moves > 0; --moves) {
+                int& voice = chord[rnd(uint32_t(chord.size()))];
+                voice = std::min(low + 30, std::max(low, voice + int(rnd(7)) - 3));
+            }
+            if (chord.size() < 6 && rnd(8) == 0) chord.push_back(low + int(rnd(24)));
+            else if (chord.size() > 3 && rnd(8) == 0) chord.pop_back();
+            std::set<int> notes(chord.begin(), chord.end());
+            std::string token;
+            for (int note : notes) {
+                if (!token.empty()) token += '~';
+                token += midi_note_name(note);
+            }
+            line += token;
+        }
+        corpus += line + "*\n";
+    }
+    return corpus + "\xe2\x80\x98\n";
+}
+
+int run_bench_schedule(int argc, char** argv) {
+    size_t bars = argc > 1 ? size_t(std::max(1, std::atoi(argv[1]))) : 2048;
+    std::string corpus = chord_bench_corpus(bars);
+    double parse_ms = 1e300, schedule_ms = 1e300;
+    size_t steps = 0, events = 0;
+    for (int round = 0; round < 5; ++round) {
+        Program prog;
+        auto t0 = std::chrono::steady_clock::now();
+        prog.audicles = parse_mida_file(corpus, prog.tempo, prog.form, nullptr);
+        auto t1 = std::chrono::steady_clock::now();
+        schedule_events_and_log(prog, config.sample_rate);
+        auto t2 = std::chrono::steady_clock::now();
+        parse_ms = std::min(parse_ms, std::chrono::duration<double, std::milli>(t1 - t0).count());
+        schedule_ms = std::min(schedule_ms, std::chrono::duration<double, std::milli>(t2 - t1).count());
+        steps = 0;
+        for (const auto& au : prog.audicles) steps += au->timeline.size();
+        events = prog.events.size();
+    }
+    std::cout << bars << " bars, " << steps << " steps, " << events << " events\n"
+        << std::fixed << std::setprecision(2)
+        << "parse " << parse_ms << " ms, schedule " << schedule_ms << " ms, "
+        << schedule_ms * 1e6 / std::max<size_t>(events, 1) << " ns/event\n";
+    return 0;
+}
+
+// ---- Self test ----
+// `self-test` schedules and renders small songs and checks what comes out,
+// exiting non-zero on a failure.
+bool self_test_check(bool ok, const char* what) {
+    std::cout << (ok ? "ok    " : "FAIL  ") << what << "\n";
+    return ok;
+}
+
+// A section played twice whose one note is held to its end: where the plays
+// meet, the first play's note off must come before the second's note on, or
+// the repeat releases the voice it has just started and is silent.
+bool self_test_held_repeat() {
+    Program prog;
+    prog.audicles = parse_mida_file("`~# A x2\n\xe2\x80\x98\n*C4 - - -*\n\xe2\x80\x98\n", prog.tempo, prog.form, nullptr);
+    schedule_events_and_log(prog, config.sample_rate);
+    size_t seam = prog.grid.sample_at[4];
+    std::vector<ScheduledEvent::Type> at_seam;
+    for (const ScheduledEvent& ev : prog.events)
+        if (ev.sample_index == seam) at_seam.push_back(ev.type);
+    bool ok = self_test_check(at_seam == std::vector<ScheduledEvent::Type>{ ScheduledEvent::NOTE_OFF, ScheduledEvent::NOTE_ON },
+        "x2 held note: note off before note on where the plays meet");
+    HeldNotes held = notes_held_at(prog, seam + 1);
+    ok &= self_test_check(held.size() == 1 && held.begin()->second.since == seam, "x2 held note: held across the seam from the second play");
+
+    // Render both plays and compare their energy once the first play's note
+    // has finished its release, when only the restarted note should sound
+    synth_tables = build_synth_tables(config, config.sample_rate);
+    global_playhead_samples.store(0);
+    std::vector<float> out(64);
+    size_t from = size_t(config.release * config.sample_rate) + out.size();
+    double energy[2] = {};
+    size_t event_idx = 0;
+    while (global_playhead_samples.load() < 2 * seam) {
+        size_t playhead = global_playhead_samples.load();
+        while (event_idx < prog.events.size() && prog.events[event_idx].sample_index <= playhead)
+            dispatch_event(prog.events[event_idx++]);
+        render_block(out.data(), jack_nframes_t(out.size()));
+        for (size_t k = 0; k < out.size(); ++k) {
+            size_t at = (playhead + k) % seam;
+            if (at >= from) energy[(playhead + k) / seam] += double(out[k]) * out[k];
+        }
+    }
+    ok &= self_test_check(energy[0] > 0 && energy[1] > 0.9 * energy[0], "x2 held note: the repeat sounds as loud as the first play");
+    return ok;
+}
+
+int run_self_test(int, char**) {
+    bool ok = self_test_held_repeat();
+    return ok ? 0 : 1;
+}
+
+// ---- Batch MIDI conversion ----
+// `convert [-o <dir>] [-j <threads>] <file or directory>...` writes a .mida
+// next to every .mid/.midi found (directories are walked recursively), or
+// under <dir> keeping the layout below each directory given.
+struct ConvertJob {
+    std::filesystem::path in;
+    std::filesystem::path out;
+};
+
+bool convert_midi_file(const ConvertJob& job) {
+    SmfFile smf;
+    if (!read_smf(job.in.string(), smf)) return false;
+    std::string mida = smf_to_mida(smf, job.in.string());
+    if (mida.empty()) return false;
+    std::error_code ec;
+    if (job.out.has_parent_path()) std::filesystem::create_directories(job.out.parent_path(), ec);
+    std::ofstream out(job.out, std::ios::binary);
+    if (!out.write(mida.data(), mida.size())) {
+        std::cerr << "Could not write " << job.out.string() << "\n";
+        return false;
+    }
+    return true;
+}
+
+int run_convert(int argc, char** argv) {
+    namespace fs = std::filesystem;
+    fs::path out_dir;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<ConvertJob> jobs;
+    auto target = [&](const fs::path& file, const fs::path& relative) {
+        fs::path out = out_dir.empty() ? file : out_dir / relative;
+        return out.replace_extension(".mida");
+    };
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ((arg == "-o" || arg == "-j") && i + 1 < argc) {
+            if (arg == "-o") out_dir = argv[++i];
+            else threads = std::max(1, std::atoi(argv[++i]));
+            continue;
+        }
+        std::error_code ec;
+        fs::path in = arg;
+        if (fs::is_directory(in, ec)) {
+            for (fs::recursive_directory_iterator it(in, ec), end; !ec && it != end; it.increment(ec)) {
+                if (it->is_regular_file(ec) && is_midi_path(it->path().string()))
+                    jobs.push_back({ it->path(), target(it->path(), fs::relative(it->path(), in, ec)) });
+            }
+        }
+        else if (fs::is_regular_file(in, ec)) {
+            jobs.push_back({ in, target(in, in.filename()) });
+        }
+        else {
+            std::cerr << "No such file or directory: " << arg << "\n";
+            return 1;
+        }
+    }
+    if (jobs.empty()) {
+        std::cerr << "usage: convert [-o <dir>] [-j <threads>] <file or directory>...\n";
+        return 1;
+    }
+
+    // Files are handed out one at a time, so a few huge ones do not stall a thread's share
+    std::atomic<size_t> next{ 0 }, failed{ 0 };
+    std::atomic<uint64_t> bytes{ 0 };
+    auto t0 = std::chrono::steady_clock::now();
+    auto worker = [&]() {
+        for (size_t j; (j = next.fetch_add(1)) < jobs.size(); ) {
+            std::error_code ec;
+            bytes += fs::file_size(jobs[j].in, ec);
+            if (!convert_midi_file(jobs[j])) ++failed;
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < std::min(threads, jobs.size()); ++t) pool.emplace_back(worker);
+    worker();
+    for (std::thread& t : pool) t.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cerr << std::fixed << std::setprecision(2) << "Converted " << jobs.size() - failed << " of " << jobs.size()
+        << " MIDI files (" << bytes / 1e6 << " MB) in " << secs << " s\n";
+    return failed ? 1 : 0;
+}
+
+// ---- Command line and config file ----
+struct ConfigKey {
+    const char* name;
+    double Config::* field;
+};
+
+// Every numeric tunable, by its config file key; flags are the same with a
+// leading "--" (dashes and underscores are interchangeable).
+const ConfigKey CONFIG_KEYS[] = {
+    { "bpm", &Config::bpm },
+    { "volume", &Config::volume },
+    { "drum_vol", &Config::drum_vol },
+    { "attack", &Config::attack },
+    { "decay", &Config::decay },
+    { "sustain", &Config::sustain },
+    { "release", &Config::release },
+    { "drum_attack", &Config::drum_attack },
+    { "drum_decay", &Config::drum_decay },
+    { "max_sustain", &Config::max_sustain },
+    { "sample_rate", &Config::sample_rate },
+    { "midi_velocity", &Config::midi_velocity },
+    { "drum_note", &Config::drum_note },
+    { "drum_velocity", &Config::drum_velocity },
+    { "drum_accent_velocity", &Config::drum_accent_velocity },
+    { "drum_ghost_velocity", &Config::drum_ghost_velocity },
+    { "midi_lookahead", &Config::midi_lookahead },
+    { "lookahead_periods", &Config::lookahead_periods },
+    { "cache_mb", &Config::cache_mb },
+    { "tracker_fps", &Config::tracker_fps },
+    { "metrics_port", &Config::metrics_port },
+};
+
+bool set_config_value(Config& cfg, std::string key, const std::string& value) {
+    std::replace(key.begin(), key.end(), '-', '_');
+    if (key == "file") {
+        cfg.mida_filename = value;
+        return true;
+    }
+    if (key == "cache_dir") {
+        cfg.cache_dir = value;
+        return true;
+    }
+    if (key == "trace_file") {
+        cfg.trace_file = value;
+        return true;
+    }
+    for (const auto& k : CONFIG_KEYS) {
+        if (key != k.name) continue;
+        try {
+            size_t used = 0;
+            double v = std::stod(value, &used);
+            if (used != value.size()) return false;
+            cfg.*k.field = v;
+            return true;
+        }
+        catch (const std::exception&) {
+            return false;
+        }
+    }
+    return false;
+}
+
+bool load_config_file(Config& cfg, const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Could not open config file: " << path << "\n";
+        return false;
+    }
+    std::string line;
+    int line_no = 0;
+    while (std::getline(in, line)) {
+        ++line_no;
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) continue;
+        size_t eq = line.find('=');
+        if (eq == std::string::npos || !set_config_value(cfg, trim(line.substr(0, eq)), trim(line.substr(eq + 1)))) {
+            std::cerr << path << ":" << line_no << ": bad config line: " << line << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Every value below ends up as a divisor in SynthTables or the scheduler,
+// or in a MIDI data byte
+bool validate_config(const Config& cfg) {
+    bool ok = valid_bpm(cfg.bpm) && cfg.sample_rate > 0 && cfg.cache_mb > 0 && cfg.tracker_fps > 0 && cfg.attack > 0 && cfg.decay > 0 && cfg.release > 0
+        && cfg.drum_attack > 0 && cfg.drum_decay > 0 && cfg.sustain >= 0 && cfg.sustain <= 1;
+    if (!ok) std::cerr << "Invalid config: times, sample_rate, cache_mb and tracker_fps must be positive, bpm at least 0.0005 and sustain within [0, 1].\n";
+    auto in_range = [](double v, double lo) { return v >= lo && v <= 127; };
+    if (ok && !(in_range(cfg.midi_velocity, 1) && in_range(cfg.drum_velocity, 1) && in_range(cfg.drum_accent_velocity, 1)
+        && in_range(cfg.drum_ghost_velocity, 1) && in_range(cfg.drum_note, 0) && cfg.midi_lookahead >= 0
+        && cfg.lookahead_periods >= 0 && cfg.volume >= 0 && cfg.drum_vol >= 0)) {
+        std::cerr << "Invalid config: MIDI velocities must be within [1, 127], drum_note within [0, 127]"
+            << " and midi_lookahead, lookahead_periods, volume and drum_vol not negative.\n";
+        ok = false;
+    }
+    if (ok && !(cfg.metrics_port >= 0 && cfg.metrics_port <= 65535 && cfg.metrics_port == std::floor(cfg.metrics_port))) {
+        std::cerr << "Invalid config: metrics_port must be a port number, or 0 for none.\n";
+        ok = false;
+    }
+    return ok;
+}
+
+struct RunOptions {
+    bool bench = false; // render offline and report timings instead of playing
+    bool watch = false; // reload the MIDA file whenever it is saved
+    bool jack_transport = false; // follow JACK transport start, stop and locate
+    bool timebase_master = false; // also publish BBT from the MIDA grid (implies jack_transport)
+    bool midi_out = false; // send the events to a JACK MIDI port as well
+    bool quantize = false; // play MIDI files on the MIDA grid instead of their own timing
+    bool quiet = false; // play without printing the log grid
+    bool tracker = false; // full-screen view of the grid instead of the scrolling log
+    std::vector<TransportCommand> transport; // --start and --loop, run before any stdin command
+};
+
+void print_usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " [--config <file>] [--bench] [--watch] [--start <pos>] [--loop <pos>-<pos>]\n"
+        << "       [--jack-transport] [--timebase-master] [--midi-out] [--quantize] [--quiet] [--tracker]\n"
+        << "       [--<key> <value> ...]\n"
+        << "       [mida_midi_or_midc_file]\n"
+        << "       " << argv0 << " convert [-o <dir>] [-j <threads>] <file or directory>...\n"
+        << "       " << argv0 << " compile [-o <file.midc>] [options] <mida_or_midi_file>\n"
+        << "       " << argv0 << " bench-schedule [bars]\n"
+        << "       " << argv0 << " self-test\n"
+        << "keys:";
+    for (const auto& k : CONFIG_KEYS) std::cerr << " " << k.name;
+    std::cerr << " file cache_dir trace_file\n"
+        << "positions are <bar>[.<sixteenth>], from 1; during playback stdin takes\n"
+        << "\"seek <pos>\", \"loop <pos>-<pos>\" and \"loop off\"\n";
+}
+
+// Defaults, then the --config file, then the remaining flags in order
+bool parse_command_line(int argc, char** argv, Config& cfg, RunOptions& opts) {
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::string(argv[i]) == "--config" && !load_config_file(cfg, argv[i + 1]))
+            return false;
+    }
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--bench") {
+            opts.bench = true;
+        }
+        else if (arg == "--watch") {
+            opts.watch = true;
+        }
+        else if (arg == "--jack-transport") {
+            opts.jack_transport = true;
+        }
+        else if (arg == "--timebase-master") {
+            opts.jack_transport = opts.timebase_master = true;
+        }
+        else if (arg == "--midi-out") {
+            opts.midi_out = true;
+        }
+        else if (arg == "--quantize") {
+            opts.quantize = true;
+        }
+        else if (arg == "--quiet") {
+            opts.quiet = true;
+        }
+        else if (arg == "--tracker") {
+            opts.tracker = true;
+        }
+        else if (arg == "--help" || arg == "-h") {
+            print_usage(argv[0]);
+            return false;
+        }
+        else if (arg == "--start" || arg == "--loop") {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for " << arg << "\n";
+                return false;
+            }
+            std::string value = argv[++i];
+            TransportCommand cmd;
+            if (!parse_transport_command((arg == "--start" ? "seek " : "loop ") + value, cmd)) {
+                std::cerr << "Bad option: " << arg << " " << value << "\n";
+                print_usage(argv[0]);
+                return false;
+            }
+            opts.transport.push_back(cmd);
+        }
+        else if (arg.compare(0, 2, "--") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for " << arg << "\n";
+                return false;
+            }
+            std::string value = argv[++i];
+            if (arg != "--config" && !set_config_value(cfg, arg.substr(2), value)) {
+                std::cerr << "Bad option: " << arg << " " << value << "\n";
+                print_usage(argv[0]);
+                return false;
+            }
+        }
+        else {
+            cfg.mida_filename = arg;
+        }
+    }
+    return validate_config(cfg);
+}
+
+// `compile [-o <file>] [options] <mida_or_midi_file>` schedules a file once, with
+// the options playback would take, and writes it as .midc (by default next to it)
+int run_compile(int argc, char** argv) {
+    std::string out;
+    std::vector<char*> args;
+    for (int i = 0; i < argc; ++i) {
+        if (std::string(argv[i]) == "-o" && i + 1 < argc) out = argv[++i];
+        else args.push_back(argv[i]);
+    }
+    RunOptions opts;
+    if (!parse_command_line(int(args.size()), args.data(), config, opts)) return 1;
+    quantize_midi = opts.quantize;
+    const std::string& in = config.mida_filename;
+    if (is_compiled_path(in)) {
+        std::cerr << in << " is already compiled\n";
+        return 1;
+    }
+    if (out.empty()) out = std::filesystem::path(in).replace_extension(".midc").string();
+    auto t0 = std::chrono::steady_clock::now();
+    std::unique_ptr<Program> prog = load_program(in, config.sample_rate);
+    if (!prog || !write_compiled_program(*prog, out)) return 1;
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    std::cerr << std::fixed << std::setprecision(2) << "Compiled " << in << " to " << out << " (" << prog->events.size()
+        << " events at " << prog->sample_rate << " Hz) in " << ms << " ms\n";
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string(argv[1]) == "convert") return run_convert(argc - 1, argv + 1);
+    if (argc > 1 && std::string(argv[1]) == "compile") return run_compile(argc - 1, argv + 1);
+    if (argc > 1 && std::string(argv[1]) == "bench-schedule") return run_bench_schedule(argc - 1, argv + 1);
+    if (argc > 1 && std::string(argv[1]) == "self-test") return run_self_test(argc - 1, argv + 1);
+    RunOptions opts;
+    if (!parse_command_line(argc, argv, config, opts)) return 1;
+
+    quantize_midi = opts.quantize;
+    quiet = opts.quiet;
+    tracker = opts.tracker && !quiet;
+#ifdef MIDA_TRACE
+    if (!config.trace_file.empty()) start_trace();
+#else
+    if (!config.trace_file.empty()) std::cerr << "trace_file ignored: built without MIDA_TRACE\n";
+#endif
+
+    // --bench renders offline, so there is no server rate to honor
+    if (opts.bench) {
+        double sample_rate = config.sample_rate;
+        synth_tables = build_synth_tables(config, sample_rate);
+        std::unique_ptr<Program> prog = load_program(config.mida_filename, sample_rate);
+        int rc = prog ? run_bench(*prog, sample_rate, 256) : 1;
+#ifdef MIDA_TRACE
+        if (trace_on && !write_trace(config.trace_file)) rc = 1;
+#endif
+        return rc;
+    }
+
+    jack_client_t* client = jack_client_open("mida", JackNullOption, nullptr);
+    if (!client) { std::cerr << "Could not open JACK client.\n"; return 1; }
+    // Schedule at the server's rate; later changes arrive through the callback
+    double sample_rate = jack_get_sample_rate(client);
+    synth_tables = build_synth_tables(config, sample_rate);
+    ProgramCache cache;
+    std::unique_ptr<Program> prog = load_program(config.mida_filename, sample_rate, opts.watch ? &cache : nullptr);
+    if (!prog) { jack_client_close(client); return 1; }
+    jack_port_t* output_port = jack_port_register(client, "out", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+    if (!output_port) { std::cerr << "Could not register JACK port.\n"; return 1; }
+    if (opts.midi_out) {
+        midi_port = jack_port_register(client, "midi_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
+        if (!midi_port) { std::cerr << "Could not register JACK MIDI port.\n"; return 1; }
+    }
+    jack_set_process_callback(client, [](jack_nframes_t nframes, void* arg) {
+        return jack_callback(nframes, arg);
+        }, output_port);
+    jack_set_sample_rate_callback(client, jack_sample_rate_callback, nullptr);
+    jack_set_xrun_callback(client, jack_xrun_callback, nullptr);
+    if (opts.jack_transport) transport_client = client;
+    if (opts.timebase_master) {
+        timebase_master = true;
+        if (jack_set_timebase_callback(client, 0, jack_timebase_callback, nullptr) != 0)
+            std::cerr << "Could not become JACK timebase master.\n";
+    }
+    if (jack_activate(client)) { std::cerr << "Cannot activate JACK client.\n"; return 1; }
+
+    const char** ports = jack_get_ports(client, nullptr, JACK_DEFAULT_AUDIO_TYPE, JackPortIsPhysical | JackPortIsInput);
+    if (ports && ports[0]) {
+        if (jack_connect(client, jack_port_name(output_port), ports[0]) != 0)
+            std::cerr << "Failed to connect to " << ports[0] << "\n";
         if (ports[1])
             if (jack_connect(client, jack_port_name(output_port), ports[1]) != 0)
                 std::cerr << "Failed to connect to " << ports[1] << "\n";
@@ -558,9 +4125,24 @@ int main() {
     }
     if (ports) jack_free((void*)ports);
 
-    playback_and_log(events, total_samples);
+    std::thread watcher;
+    if (opts.watch) watcher = std::thread(watch_and_reload, config.mida_filename, &cache);
+    for (const TransportCommand& cmd : opts.transport) queue_transport_command(cmd);
+    std::thread transport(read_transport_commands);
+    std::thread metrics_server;
+    if (config.metrics_port) metrics_server = std::thread(serve_metrics, client, int(config.metrics_port));
 
+    playback_and_log(std::move(prog), sample_rate);
+
+    transport.join();
+    if (watcher.joinable()) watcher.join();
+    if (metrics_server.joinable()) metrics_server.join();
+    if (opts.timebase_master) jack_release_timebase(client);
+    delete pending_program.exchange(nullptr);
     std::this_thread::sleep_for(std::chrono::milliseconds(500));
     jack_client_close(client);
+#ifdef MIDA_TRACE
+    if (trace_on && !write_trace(config.trace_file)) return 1;
+#endif
     return 0;
 }